@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+"""usage: compare.py SCRIPT BINARY...
+
+Runs SCRIPT with each BINARY a few times, and reports the best
+wall-clock time and the peak resident set size of each.
+"""
+import os
+import sys
+import time
+
+RUNS = 5
+
+
+def run(binary, script):
+    start = time.perf_counter()
+    pid = os.spawnv(os.P_NOWAIT, binary, [binary, script])
+    _, status, usage = os.wait4(pid, 0)
+    elapsed = time.perf_counter() - start
+    if status != 0:
+        sys.exit(f"{binary} {script}: exited with status {status}")
+    return elapsed, usage.ru_maxrss
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__)
+    script, binaries = sys.argv[1], sys.argv[2:]
+    print(f"{script}:")
+    for binary in binaries:
+        results = [run(binary, script) for _ in range(RUNS)]
+        best = min(t for t, _ in results)
+        rss = max(m for _, m in results)
+        print(f"  {binary:24} {best:7.3f}s {rss / 1024:8.1f} MiB")
+
+
+if __name__ == "__main__":
+    main()
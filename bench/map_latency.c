@@ -0,0 +1,63 @@
+// Latency of Map set and delete while a map grows to `n` entries and
+// is then emptied again: most operations are quick, the ones that
+// resize the hash part aren't. Build it with `make bench_map_latency`,
+// which compares incremental resizing with rebuilding at once.
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* name, float* times, uint32_t n) {
+    qsort(times, n, sizeof(float), compare);
+    printf("  %-8s p50 %6.0f ns  p99 %6.0f ns  p99.99 %8.0f ns  max %9.0f ns\n",
+           name, times[n / 2], times[(size_t)n * 99 / 100],
+           times[(size_t)n * 9999 / 10000], times[n - 1]);
+}
+
+// Keys are spread out, so they all go to the hash part.
+static Value key(uint32_t i) {
+    return NUMBER_TO_VAL(i * 7.5 + 0.5);
+}
+
+int main(void) {
+    VM vm;
+    vm_init(&vm);
+    const uint32_t sizes[] = { 100000, 1000000, 4000000 };
+    for (int s = 0; s < 3; s++) {
+        uint32_t n = sizes[s];
+        float* times = malloc(sizeof(float) * n);
+        ObjMap* map = objmap_new(&vm);
+        vm_push_root(&vm, OBJ_TO_VAL(map));
+        printf("%u entries:\n", n);
+        for (uint32_t i = 0; i < n; i++) {
+            double start = now();
+            objmap_set(map, &vm, key(i), NUMBER_TO_VAL(i));
+            times[i] = (float)((now() - start) * 1e9);
+        }
+        report("set", times, n);
+        for (uint32_t i = 0; i < n; i++) {
+            double start = now();
+            objmap_delete(map, &vm, key(i));
+            times[i] = (float)((now() - start) * 1e9);
+        }
+        report("delete", times, n);
+        vm_pop_root(&vm);
+        free(times);
+    }
+    vm_free(&vm);
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Microbenchmark for Table: set, get (hits and misses) and delete,
+// with number keys and interned string keys. Build it with
+// `make bench_table`, which also counts the groups of control bytes
+// each lookup probes.
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifdef SUBTLE_DEBUG_TABLE_STATS
+static size_t lookups_start, probes_start;
+#define STATS_START() (lookups_start = table_lookups, probes_start = table_probes)
+#define STATS_PRINT() \
+    printf(" %5.2f probes", (double)(table_probes - probes_start) \
+                            / (table_lookups - lookups_start))
+#else
+#define STATS_START() ((void)0)
+#define STATS_PRINT() ((void)0)
+#endif
+
+#define TIME(name, n, body) \
+    do { \
+        STATS_START(); \
+        double start = now(); \
+        body; \
+        printf("  %-8s %7.1f ns/op", name, (now() - start) * 1e9 / (n)); \
+        STATS_PRINT(); \
+        printf("\n"); \
+    } while (false)
+
+// Keys i (for i < n) are set, keys n + i are missing.
+static void run(VM* vm, const char* kind, ObjList* keys, uint32_t n, int rounds) {
+    printf("%s keys, %u entries:\n", kind, n);
+    Table table;
+    Value v;
+    size_t found = 0;
+    table_init(&table);
+    TIME("set", (double)n * rounds, {
+        for (int r = 0; r < rounds; r++) {
+            table_free(&table, vm);
+            for (uint32_t i = 0; i < n; i++)
+                table_set(&table, vm, keys->values[i], NUMBER_TO_VAL(i));
+        }
+    });
+    TIME("get", (double)n * rounds, {
+        for (int r = 0; r < rounds; r++)
+            for (uint32_t i = 0; i < n; i++)
+                found += table_get(&table, keys->values[i], &v);
+    });
+    TIME("miss", (double)n * rounds, {
+        for (int r = 0; r < rounds; r++)
+            for (uint32_t i = 0; i < n; i++)
+                found += table_get(&table, keys->values[n + i], &v);
+    });
+    TIME("delete", n, {
+        for (uint32_t i = 0; i < n; i++)
+            table_delete(&table, vm, keys->values[i]);
+    });
+    if (found != (size_t)n * rounds)
+        printf("  wrong number of keys found: %zu\n", found);
+    table_free(&table, vm);
+}
+
+int main(void) {
+    VM vm;
+    vm_init(&vm);
+    const uint32_t sizes[] = { 100, 10000, 1000000 };
+    for (int s = 0; s < 3; s++) {
+        uint32_t n = sizes[s];
+        int rounds = 10000000 / n;
+        ObjList* keys = objlist_new(&vm, 2 * n);
+        vm_push_root(&vm, OBJ_TO_VAL(keys));
+        for (uint32_t i = 0; i < 2 * n; i++)
+            keys->values[i] = NUMBER_TO_VAL(i * 7.0);
+        run(&vm, "Number", keys, n, rounds);
+        for (uint32_t i = 0; i < 2 * n; i++) {
+            char buf[32];
+            int length = snprintf(buf, sizeof(buf), "key%u", i);
+            objlist_set(keys, &vm, i, OBJ_TO_VAL(objstring_copy(&vm, buf, length)));
+        }
+        run(&vm, "String", keys, n, rounds);
+        vm_pop_root(&vm);
+    }
+    vm_free(&vm);
+    return 0;
+}
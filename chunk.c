@@ -8,6 +8,9 @@ void chunk_init(Chunk* chunk) {
     chunk->capacity = 0;
     valuearray_init(&chunk->constants);
     table_init(&chunk->constants_index);
+    chunk->caches = NULL;
+    chunk->caches_count = 0;
+    chunk->caches_capacity = 0;
 }
 
 void chunk_done(Chunk* chunk, VM* vm) {
@@ -20,6 +23,7 @@ void chunk_free(Chunk* chunk, VM* vm) {
     FREE_ARRAY(vm, chunk->code, uint8_t, chunk->capacity);
     FREE_ARRAY(vm, chunk->lines, uint32_t, chunk->capacity);
     valuearray_free(&chunk->constants, vm);
+    FREE_ARRAY(vm, chunk->caches, InlineCache, chunk->caches_capacity);
     // Just in case we didn't call chunk_done()
     table_free(&chunk->constants_index, vm);
     chunk_init(chunk);
@@ -63,6 +67,19 @@ int chunk_write_constant(Chunk* chunk, VM* vm, Value value) {
     return rv;
 }
 
+int chunk_add_cache(Chunk* chunk, VM* vm) {
+    if (chunk->caches_count + 1 > chunk->caches_capacity) {
+        int new_size = GROW_CAPACITY(chunk->caches_capacity);
+        chunk->caches = GROW_ARRAY(vm, chunk->caches, InlineCache, chunk->caches_capacity, new_size);
+        chunk->caches_capacity = new_size;
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->caches_count];
+    cache->epoch = 0;
+    cache->count = 0;
+    return chunk->caches_count++;
+}
+
 void chunk_mark(Chunk* chunk, VM* vm) {
     valuearray_mark(&chunk->constants, vm);
 }
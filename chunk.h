@@ -30,15 +30,70 @@ enum OpCode {
     OP_OBJECT,
     OP_OBJLIT_SET,
     OP_INVOKE,
+    // Operators. These behave like an OP_INVOKE of the operator's
+    // slot (and share its operands, minus the argument count), but
+    // compute the result directly when the slot is still the core's
+    // native implementation.
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LT,
+    OP_LEQ,
+    OP_GT,
+    OP_GEQ,
+    OP_EQ,
+    OP_NEQ,
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_NEG,
+    OP_NOT,
+    // The iterMore/iterNext calls of a for loop, with fast paths
+    // for List, Range and String.
+    OP_ITER_MORE,
+    OP_ITER_NEXT,
+    // Counted loops over a literal range, see for_range in compiler.c.
+    OP_RANGE,      // inclusive(1) name(2) cache(2)
+    OP_RANGE_MORE, // inclusive(1) slot(1) name(2) cache(2)
+    OP_RANGE_NEXT, // inclusive(1) slot(1) name(2) cache(2)
 };
 
+// Inline caches
+// =============
+// Every OP_INVOKE site owns an InlineCache, which remembers where the
+// slot was found for the last few receivers seen at that site. The
+// receiver is identified by the object where the lookup starts: the
+// receiver itself for ObjObjects, or its prototype otherwise.
+// Receivers with a shape are identified by their shape instead, see
+// shape_cache_lookup in vm.c.
+// Entries are only valid while ->epoch matches vm->ic_epoch.
+#define IC_SIZE 4
+
+typedef struct Shape Shape;
+
+typedef struct {
+    Obj* klass;     // Where the lookup starts.
+    Shape* shape;   // The receiver's shape, or NULL.
+    Value* slot;    // Where the slot's value lives.
+    uint32_t index; // Index into the receiver's values (own slots).
+} ICEntry;
+
+typedef struct {
+    uint32_t epoch;
+    uint8_t count;
+    ICEntry entries[IC_SIZE];
+} InlineCache;
+
 typedef struct Chunk {
-    uint8_t*   code;
-    int*       lines;
-    int        length;
-    int        capacity;
-    ValueArray constants;
-    Table      constants_index;
+    uint8_t*     code;
+    int*         lines;
+    int          length;
+    int          capacity;
+    ValueArray   constants;
+    Table        constants_index;
+    InlineCache* caches;
+    int          caches_count;
+    int          caches_capacity;
 } Chunk;
 
 typedef struct VM VM;
@@ -50,6 +105,7 @@ void chunk_write_byte(Chunk* chunk, VM* vm, uint8_t byte, int line);
 void chunk_write_offset(Chunk* chunk, VM* vm, uint16_t offset, int line);
 int chunk_get_line(Chunk* chunk, int offset);
 int chunk_write_constant(Chunk* chunk, VM* vm, Value v);
+int chunk_add_cache(Chunk* chunk, VM* vm);
 void chunk_mark(Chunk* chunk, VM* vm);
 
 #endif
@@ -11,6 +11,17 @@
 /* #define SUBTLE_DEBUG_TRACE_ALLOC */
 /* #define SUBTLE_DEBUG_STRESS_GC */
 /* #define SUBTLE_MALLOC_TRIM */
+/* #define SUBTLE_NO_COMPUTED_GOTO */
+/* #define SUBTLE_NAN_BOXING */
+/* #define SUBTLE_NO_GENERATIONAL_GC */
+/* #define SUBTLE_NO_INCREMENTAL_GC */
+/* #define SUBTLE_DEBUG_PRINT_GC_STATS */
+
+// Dispatch instructions with computed gotos (a GNU extension) when
+// the compiler supports them, see run() in vm.c.
+#if defined(__GNUC__) && !defined(SUBTLE_NO_COMPUTED_GOTO)
+    #define SUBTLE_COMPUTED_GOTO
+#endif
 
 #ifdef SUBTLE_DEBUG
     #include <stdio.h>
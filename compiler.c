@@ -76,6 +76,11 @@ typedef struct Compiler {
     int scope_depth; // Current scope depth.
     Loop* loop;
 
+    // Offset of the OP_INVOKE emitted for the last `..` or `...`, so
+    // that for_stmt can tell if its sequence is a literal range.
+    int range_op;
+    bool range_inclusive;
+
     VM* vm;
 } Compiler;
 
@@ -128,6 +133,7 @@ compiler_init(Compiler* compiler, Compiler* enclosing,
     compiler->scope_depth = 0;
     compiler->vm = vm;
     compiler->loop = NULL;
+    compiler->range_op = -1;
 
     Local* local = &compiler->locals[compiler->local_count++];
     local->depth = 0;
@@ -253,6 +259,25 @@ static int stack_effects[] = {
     [OP_OBJECT] = 1,
     [OP_OBJLIT_SET] = -1,
     [OP_INVOKE] = 0,
+    [OP_ADD] = -1,
+    [OP_SUB] = -1,
+    [OP_MUL] = -1,
+    [OP_DIV] = -1,
+    [OP_LT] = -1,
+    [OP_LEQ] = -1,
+    [OP_GT] = -1,
+    [OP_GEQ] = -1,
+    [OP_EQ] = -1,
+    [OP_NEQ] = -1,
+    [OP_BIT_AND] = -1,
+    [OP_BIT_OR] = -1,
+    [OP_NEG] = 0,
+    [OP_NOT] = 0,
+    [OP_ITER_MORE] = -1,
+    [OP_ITER_NEXT] = -1,
+    [OP_RANGE] = 0, // Never emitted directly, see for_range.
+    [OP_RANGE_MORE] = 2,
+    [OP_RANGE_NEXT] = 2,
 };
 
 static void emit_op(Compiler* compiler, uint8_t op) {
@@ -279,6 +304,15 @@ static uint16_t make_constant(Compiler* compiler, Value v) {
     return offset;
 }
 
+static uint16_t make_cache(Compiler* compiler) {
+    int cache = chunk_add_cache(current_chunk(compiler), compiler->vm);
+    if (cache > UINT16_MAX) {
+        error(compiler, "Too many call sites in one chunk.");
+        return 0;
+    }
+    return cache;
+}
+
 static uint16_t identifier_constant(Compiler* compiler, const Token* token) {
     return make_constant(compiler,
         OBJ_TO_VAL(objstring_copy(
@@ -288,6 +322,18 @@ static uint16_t identifier_constant(Compiler* compiler, const Token* token) {
         )));
 }
 
+static uint16_t identifier_global(Compiler* compiler, const Token* token) {
+    if (compiler->parser->had_error)
+        return 0;
+    ObjString* name = objstring_copy(compiler->vm, token->start, token->length);
+    int index = vm_global_index(compiler->vm, name);
+    if (index > UINT16_MAX) {
+        error(compiler, "Too many globals.");
+        return 0;
+    }
+    return index;
+}
+
 static void emit_constant(Compiler* compiler, Value v) {
     // Subtle point: the make_constant call has to come _before_ the
     // call to emit_byte(), because v might be freed during emit_byte.
@@ -323,6 +369,8 @@ compiler_end(Compiler* compiler)
     }
 #endif
     chunk_done(current_chunk(compiler), compiler->vm);
+    // compiler_mark no longer covers the function from now on.
+    memory_barrier(compiler->vm, (Obj*)compiler->fn);
     return compiler->fn;
 }
 
@@ -469,6 +517,9 @@ patch_jump(Compiler* compiler, int offset)
 
     current_chunk(compiler)->code[offset    ] = (jump >> 8) & 0xFF;
     current_chunk(compiler)->code[offset + 1] = (jump)      & 0xFF;
+    // Something jumps to the end of the code now (e.g. `a && 0..3`),
+    // so the last range can't be treated as the whole expression.
+    compiler->range_op = -1;
 }
 
 static void
@@ -495,8 +546,9 @@ invoke_token_method(Compiler* compiler, const Token* tok, int num_args)
 {
     uint16_t method_constant = identifier_constant(compiler, tok);
     emit_op(compiler, OP_INVOKE);
-    emit_offset(compiler, method_constant);
     emit_byte(compiler, (uint8_t) num_args);
+    emit_offset(compiler, method_constant);
+    emit_offset(compiler, make_cache(compiler));
     // OP_INVOKE would pop the arguments, and leave the result.
     // Decrement the slot count accordingly.
     ASSERT(compiler->slot_count > num_args, "compiler->slot_count <= num_args");
@@ -510,6 +562,18 @@ invoke_string_method(Compiler* compiler, const char* method, int num_args)
     invoke_token_method(compiler, &tok, num_args);
 }
 
+// Emits one of the operator instructions (OP_ADD, ...), which invoke
+// the slot `method` unless the VM can compute the result directly.
+static void
+invoke_operator(Compiler* compiler, uint8_t op, const char* method)
+{
+    const Token tok = {.start=method, .length=strlen(method)};
+    uint16_t method_constant = identifier_constant(compiler, &tok);
+    emit_op(compiler, op);
+    emit_offset(compiler, method_constant);
+    emit_offset(compiler, make_cache(compiler));
+}
+
 // Expression parsing
 // ==================
 
@@ -593,7 +657,7 @@ static void named_variable(Compiler* compiler, Token name, bool can_assign, bool
     }
 
     // Otherwise, it's a global.
-    uint16_t global = identifier_constant(compiler, &name);
+    uint16_t global = identifier_global(compiler, &name);
     if (can_assign && match(compiler, TOKEN_EQ)) {
         match_newlines(compiler);
         expression(compiler, allow_newlines);
@@ -727,12 +791,8 @@ static void unary(Compiler* compiler, bool can_assign, bool allow_newlines) {
     // Compile the operand.
     parse_precedence(compiler, PREC_PREFIX, allow_newlines);
     switch (operator) {
-        case TOKEN_MINUS:
-            invoke_string_method(compiler, "neg", 0);
-            return;
-        case TOKEN_BANG:
-            invoke_token_method(compiler, &op_token, 0);
-            break;
+        case TOKEN_MINUS: invoke_operator(compiler, OP_NEG, "neg"); break;
+        case TOKEN_BANG:  invoke_operator(compiler, OP_NOT, "!"); break;
         default: UNREACHABLE();
     }
 }
@@ -749,20 +809,22 @@ static void binary(Compiler* compiler, bool can_assign, bool allow_newlines) {
     switch (operator) {
         case TOKEN_DOTDOT:
         case TOKEN_DOTDOTDOT:
-        case TOKEN_EQ_EQ:
-        case TOKEN_BANG_EQ:
-        case TOKEN_PLUS:
-        case TOKEN_MINUS:
-        case TOKEN_TIMES:
-        case TOKEN_SLASH:
-        case TOKEN_LT:
-        case TOKEN_LEQ:
-        case TOKEN_GT:
-        case TOKEN_GEQ:
-        case TOKEN_AMP:
-        case TOKEN_PIPE:
+            compiler->range_op = current_chunk(compiler)->length;
+            compiler->range_inclusive = operator == TOKEN_DOTDOT;
             invoke_token_method(compiler, &op_token, 1);
             break;
+        case TOKEN_EQ_EQ:   invoke_operator(compiler, OP_EQ,      "=="); break;
+        case TOKEN_BANG_EQ: invoke_operator(compiler, OP_NEQ,     "!="); break;
+        case TOKEN_PLUS:    invoke_operator(compiler, OP_ADD,     "+"); break;
+        case TOKEN_MINUS:   invoke_operator(compiler, OP_SUB,     "-"); break;
+        case TOKEN_TIMES:   invoke_operator(compiler, OP_MUL,     "*"); break;
+        case TOKEN_SLASH:   invoke_operator(compiler, OP_DIV,     "/"); break;
+        case TOKEN_LT:      invoke_operator(compiler, OP_LT,      "<"); break;
+        case TOKEN_LEQ:     invoke_operator(compiler, OP_LEQ,     "<="); break;
+        case TOKEN_GT:      invoke_operator(compiler, OP_GT,      ">"); break;
+        case TOKEN_GEQ:     invoke_operator(compiler, OP_GEQ,     ">="); break;
+        case TOKEN_AMP:     invoke_operator(compiler, OP_BIT_AND, "&"); break;
+        case TOKEN_PIPE:    invoke_operator(compiler, OP_BIT_OR,  "|"); break;
         default: UNREACHABLE();
     }
 }
@@ -940,7 +1002,7 @@ static uint16_t parse_variable(Compiler* compiler, const char* msg) {
     if (compiler->scope_depth > 0)
         return 0;
 
-    return identifier_constant(compiler, &compiler->parser->previous);
+    return identifier_global(compiler, &compiler->parser->previous);
 }
 
 static void let_decl(Compiler* compiler) {
@@ -1018,6 +1080,92 @@ static void load_local(Compiler* compiler, int offset) {
     emit_byte(compiler, offset);
 }
 
+// Emits OP_RANGE_MORE or OP_RANGE_NEXT, which work on the three
+// hidden locals of a counted for loop, starting at `slot`.
+static void
+emit_range_op(Compiler* compiler, uint8_t op, bool inclusive, int slot, const char* method)
+{
+    const Token tok = {.start=method, .length=strlen(method)};
+    uint16_t method_constant = identifier_constant(compiler, &tok);
+    emit_op(compiler, op);
+    emit_byte(compiler, inclusive);
+    emit_byte(compiler, (uint8_t) slot);
+    emit_offset(compiler, method_constant);
+    emit_offset(compiler, make_cache(compiler));
+    // If the fast path doesn't apply, the instruction pushes the
+    // range and the iterator value and then invokes `method`.
+    compiler->slot_count -= 1;
+}
+
+static void for_body(Compiler* compiler, Token loop_var) {
+    // push a fresh block for every iteration
+    begin_block(compiler);
+    add_local(compiler, loop_var);
+    mark_local_initialized(compiler);
+    block_or_stmt(compiler);
+    end_block(compiler);
+
+    exit_loop(compiler);
+}
+
+static void for_range(Compiler* compiler, Token loop_var) {
+    // If the sequence is a literal range, then we can usually get
+    // away without creating the Range:
+    // for (x = a..b) {  | let _a = a;
+    //    bar;           | let _b = b;
+    // }                 | let _i = nil;
+    //                   | while (_i = range_iter_more(_a, _b, _i)) {
+    //                   |     let x = _i;
+    //                   |     bar;
+    //                   | }
+    // OP_RANGE checks that a and b are Numbers, and that `..` hasn't
+    // been redefined. Otherwise it creates the range for real, and
+    // leaves nil in _a and the range in _b. OP_RANGE_MORE and
+    // OP_RANGE_NEXT then invoke iterMore and iterNext on the range.
+    Token start_token = {.start="start ", .length=6};
+    Token end_token   = {.start="end ", .length=4};
+    Token iter_token  = {.start="iter ", .length=5};
+
+    bool inclusive = compiler->range_inclusive;
+
+    // Turn the range's OP_INVOKE into OP_RANGE. Both have the same
+    // operands, except that the argument count becomes the flag.
+    Chunk* chunk = current_chunk(compiler);
+    chunk->code[compiler->range_op] = OP_RANGE;
+    chunk->code[compiler->range_op + 1] = inclusive;
+    compiler->range_op = -1;
+
+    // Unlike the invoke, OP_RANGE leaves both operands on the stack,
+    // and it needs an extra slot if it has to create the range.
+    compiler->slot_count++;
+    if (compiler->fn->max_slots < compiler->slot_count + 1)
+        compiler->fn->max_slots = compiler->slot_count + 1;
+
+    int start = add_local(compiler, start_token);
+    mark_local_initialized(compiler);
+    add_local(compiler, end_token);
+    mark_local_initialized(compiler);
+
+    emit_op(compiler, OP_NIL);
+    int iter = add_local(compiler, iter_token);
+    mark_local_initialized(compiler);
+
+    consume(compiler, TOKEN_RPAREN, "Expect ')' after loop expression.");
+
+    Loop loop;
+    enter_loop(compiler, &loop);
+
+    // _i = range_iter_more(_a, _b, _i)
+    emit_range_op(compiler, OP_RANGE_MORE, inclusive, start, "iterMore");
+    emit_op(compiler, OP_SET_LOCAL); emit_byte(compiler, (uint8_t) iter);
+    test_exit_loop(compiler);
+
+    // loop_var = _i
+    emit_range_op(compiler, OP_RANGE_NEXT, inclusive, start, "iterNext");
+
+    for_body(compiler, loop_var);
+}
+
 static void for_stmt(Compiler* compiler) {
     // Desugar the following for loop:
     // for (x = items) {  | let _s = items;
@@ -1042,14 +1190,24 @@ static void for_stmt(Compiler* compiler) {
     match(compiler, TOKEN_NEWLINE);
 
     // Evaluate the sequence.
+    compiler->range_op = -1;
     expression(compiler, true);
 
-    // Check that we have enough space to store the two locals.
-    if (compiler->local_count + 2 > MAX_LOCALS) {
+    // Check that we have enough space to store the hidden locals.
+    if (compiler->local_count + 3 > MAX_LOCALS) {
         error(compiler, "Not enough space for for-loop variables.");
         return;
     }
 
+    // Is the whole sequence expression a `..` or `...`?
+    // (The range's OP_INVOKE is 6 bytes long.)
+    if (compiler->range_op != -1
+            && compiler->range_op + 6 == current_chunk(compiler)->length) {
+        for_range(compiler, loop_var);
+        end_block(compiler);
+        return;
+    }
+
     int seq = add_local(compiler, seq_token);
     mark_local_initialized(compiler);
 
@@ -1066,23 +1224,16 @@ static void for_stmt(Compiler* compiler) {
     // _i = _s.iterMore(_i)
     load_local(compiler, seq);
     load_local(compiler, iter);
-    invoke_string_method(compiler, "iterMore", 1);
+    invoke_operator(compiler, OP_ITER_MORE, "iterMore");
     emit_op(compiler, OP_SET_LOCAL); emit_byte(compiler, (uint8_t) iter);
     test_exit_loop(compiler);
 
     // loop_var = _s.iterNext(_i)
     load_local(compiler, seq);
     load_local(compiler, iter);
-    invoke_string_method(compiler, "iterNext", 1);
+    invoke_operator(compiler, OP_ITER_NEXT, "iterNext");
 
-    // push a fresh block for every iteration
-    begin_block(compiler);
-    add_local(compiler, loop_var);
-    mark_local_initialized(compiler);
-    block_or_stmt(compiler);
-    end_block(compiler);
-
-    exit_loop(compiler);
+    for_body(compiler, loop_var);
 
     end_block(compiler);
 }
@@ -1197,4 +1348,6 @@ compiler_mark(Compiler* compiler, VM* vm)
     // mark the enclosing compiler.
     compiler_mark(compiler->enclosing, vm);
     mark_object(vm, (Obj*)compiler->fn);
+    // The function is written to without barriers while we compile it.
+    memory_barrier(vm, (Obj*)compiler->fn);
 }
@@ -1,6 +1,7 @@
 #include "core.h"
 
 #include "core.subtle.inc"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -13,12 +14,12 @@
 #include <stdio.h>
 
 static inline void
-define_on_table(VM* vm, Table* table, const char* name, Value value) {
+define_on_object(VM* vm, ObjObject* object, const char* name, Value value) {
     vm_push_root(vm, value);
     Value key = OBJ_TO_VAL(objstring_copy(vm, name, strlen(name)));
     vm_push_root(vm, key);
 
-    table_set(table, vm, key, value);
+    objobject_set(object, vm, key, value);
     vm_pop_root(vm);
     vm_pop_root(vm);
 }
@@ -71,6 +72,8 @@ define_on_table(VM* vm, Table* table, const char* name, Value value) {
         case 'L': CHECK_TYPE(idx, arg, IS_LIST, "a List"); break; \
         case 'M': CHECK_TYPE(idx, arg, IS_MAP, "a Map"); break; \
         case 'm': CHECK_TYPE(idx, arg, IS_MSG, "a Msg"); break; \
+        case 'w': CHECK_TYPE(idx, arg, IS_WEAKREF, "a WeakRef"); break; \
+        case 'W': CHECK_TYPE(idx, arg, IS_WEAKMAP, "a WeakMap"); break; \
         case '*': break; \
         default: UNREACHABLE(); \
         } \
@@ -104,30 +107,13 @@ value_to_index(Value v, uint32_t length, uint32_t* idx)
 static bool
 next_index(Value arg, uint32_t length, uint32_t* rv)
 {
-    double idx = -1;
-    if (IS_NIL(arg)) {
-        idx = 0;
-    } else if (IS_NUMBER(arg)) {
-        idx = VAL_TO_NUMBER(arg);
-        idx++;
-        if (!is_integer(idx)) return false;
-    }
-    if (idx < 0 || idx >= length)
+    Value idx = sequence_iter_more(arg, length);
+    if (!IS_NUMBER(idx))
         return false;
-    *rv = (uint32_t) idx;
+    *rv = (uint32_t) VAL_TO_NUMBER(idx);
     return true;
 }
 
-// A generic implementation of iterMore for sized sequences.
-static Value
-generic_iterMore(Value arg, uint32_t length)
-{
-    uint32_t idx;
-    if (!next_index(arg, length, &idx))
-        return FALSE_VAL;
-    return NUMBER_TO_VAL(idx);
-}
-
 // generic implementation to check if the table still has any
 // valid entries after entry i.
 static Value
@@ -237,8 +223,10 @@ DEFINE_NATIVE(Object_setSlot) {
     ARGSPEC("O**");
     if (IS_STRING(args[1]) && IS_CLOSURE(args[2])) {
         ObjFn* fn = VAL_TO_CLOSURE(args[2])->fn;
-        if (fn->name == NULL)
+        if (fn->name == NULL) {
             fn->name = VAL_TO_STRING(args[1]);
+            memory_barrier(vm, (Obj*)fn);
+        }
     }
     objobject_set(VAL_TO_OBJECT(args[0]), vm, args[1], args[2]);
     RETURN(args[2]);
@@ -335,7 +323,7 @@ DEFINE_NATIVE(Object_is) {
 
 DEFINE_NATIVE(Object_type) {
     Value v = args[0];
-    switch (v.type) {
+    switch (VALUE_TYPE(v)) {
     case VALUE_NIL:    RETURN(OBJ_TO_VAL(CONST_STRING(vm, "nil")));
     case VALUE_TRUE:   RETURN(OBJ_TO_VAL(CONST_STRING(vm, "true")));
     case VALUE_FALSE:  RETURN(OBJ_TO_VAL(CONST_STRING(vm, "false")));
@@ -352,6 +340,8 @@ DEFINE_NATIVE(Object_type) {
         case OBJ_MAP:     RETURN(OBJ_TO_VAL(CONST_STRING(vm, "Map")));
         case OBJ_MSG:     RETURN(OBJ_TO_VAL(CONST_STRING(vm, "Msg")));
         case OBJ_FOREIGN: RETURN(OBJ_TO_VAL(CONST_STRING(vm, "Foreign")));
+        case OBJ_WEAKREF: RETURN(OBJ_TO_VAL(CONST_STRING(vm, "WeakRef")));
+        case OBJ_WEAKMAP: RETURN(OBJ_TO_VAL(CONST_STRING(vm, "WeakMap")));
         default: UNREACHABLE();
         }
     default: UNREACHABLE();
@@ -377,7 +367,7 @@ num_to_string(VM* vm, double num) {
 
 DEFINE_NATIVE(Object_toString) {
     Value self = args[0];
-    switch (self.type) {
+    switch (VALUE_TYPE(self)) {
     case VALUE_NIL:    RETURN(OBJ_TO_VAL(CONST_STRING(vm, "nil")));
     case VALUE_TRUE:   RETURN(OBJ_TO_VAL(CONST_STRING(vm, "true")));
     case VALUE_FALSE:  RETURN(OBJ_TO_VAL(CONST_STRING(vm, "false")));
@@ -402,6 +392,8 @@ DEFINE_NATIVE(Object_toString) {
         case OBJ_MAP:     prefix = "Map"; break;
         case OBJ_MSG:     prefix = "Msg"; break;
         case OBJ_FOREIGN: prefix = "Foreign"; break;
+        case OBJ_WEAKREF: prefix = "WeakRef"; break;
+        case OBJ_WEAKMAP: prefix = "WeakMap"; break;
         default:          UNREACHABLE();
         }
         length = sprintf(buffer, "%s_%p", prefix, (void*) obj);
@@ -430,6 +422,8 @@ DEFINE_NATIVE(Object_print) {
 DEFINE_NATIVE(Object_rawIterMore) {
     ARGSPEC("O*");
     ObjObject* obj = VAL_TO_OBJECT(args[0]);
+    if (obj->shape != NULL)
+        RETURN(sequence_iter_more(args[1], obj->shape->count));
     Value rv = generic_tableIterMore(&obj->slots, args[1]);
     RETURN(rv);
 }
@@ -437,6 +431,12 @@ DEFINE_NATIVE(Object_rawIterMore) {
 DEFINE_NATIVE(Object_rawSlotAt) {
     ARGSPEC("ON");
     ObjObject* obj = VAL_TO_OBJECT(args[0]);
+    if (obj->shape != NULL) {
+        uint32_t idx;
+        if (value_to_index(args[1], obj->shape->count, &idx))
+            RETURN(obj->shape->keys[idx]);
+        RETURN(NIL_VAL);
+    }
     Entry entry;
     if (generic_tableIterEntry(&obj->slots, args[1], &entry))
         RETURN(entry.key);
@@ -446,6 +446,12 @@ DEFINE_NATIVE(Object_rawSlotAt) {
 DEFINE_NATIVE(Object_rawValueAt) {
     ARGSPEC("ON");
     ObjObject* obj = VAL_TO_OBJECT(args[0]);
+    if (obj->shape != NULL) {
+        uint32_t idx;
+        if (value_to_index(args[1], obj->shape->count, &idx))
+            RETURN(obj->values[idx]);
+        RETURN(NIL_VAL);
+    }
     Entry entry;
     if (generic_tableIterEntry(&obj->slots, args[1], &entry))
         RETURN(entry.value);
@@ -666,8 +672,7 @@ DEFINE_NATIVE(String_get) {
 DEFINE_NATIVE(String_iterMore) {
     ARGSPEC("S*");
     ObjString* s = VAL_TO_STRING(args[0]);
-    Value rv = generic_iterMore(args[1], s->length);
-    RETURN(rv);
+    RETURN(sequence_iter_more(args[1], s->length));
 }
 
 // ============================= Fiber =============================
@@ -703,6 +708,8 @@ run_fiber(VM* vm, ObjFiber* fiber,
         fiber->stack_top[-1] = value;
     }
     fiber->parent = vm->fiber;
+    memory_barrier(vm, (Obj*)fiber);
+    memory_barrier(vm, (Obj*)vm->fiber);
     vm->fiber = fiber;
     return true;
 }
@@ -722,6 +729,7 @@ DEFINE_NATIVE(Fiber_yield) {
     ObjFiber* parent = vm->fiber->parent;
     vm->fiber->state = FIBER_OTHER;
     vm->fiber->parent = NULL;
+    memory_barrier(vm, (Obj*)vm->fiber);
     vm->fiber = parent;
     if (vm->fiber != NULL) {
         vm->fiber->stack_top[-1] = v;
@@ -808,33 +816,7 @@ DEFINE_NATIVE(Range_end) {
 DEFINE_NATIVE(Range_iterMore) {
     ARGSPEC("r*");
     ObjRange* range = VAL_TO_RANGE(args[0]);
-    // nothing to iterate?
-    if (range->start == range->end && !range->inclusive)
-        RETURN(FALSE_VAL);
-
-    double v;
-    if (IS_NIL(args[1])) {
-        // start of the iteration.
-        v = range->start;
-    } else if (IS_NUMBER(args[1])) {
-        v = VAL_TO_NUMBER(args[1]);
-        if (range->start <= range->end) {
-            // 0..5 or 0...5
-            v = v + 1;
-            if (v < range->start) RETURN(FALSE_VAL);
-            if (range->inclusive && v > range->end) RETURN(FALSE_VAL);
-            if (!range->inclusive && v >= range->end) RETURN(FALSE_VAL);
-        } else {
-            // 5..0 or 5...0
-            v = v - 1;
-            if (v > range->start) RETURN(FALSE_VAL);
-            if (range->inclusive && v < range->end) RETURN(FALSE_VAL);
-            if (!range->inclusive && v <= range->end) RETURN(FALSE_VAL);
-        }
-    } else {
-        RETURN(FALSE_VAL);
-    }
-    RETURN(NUMBER_TO_VAL(v));
+    RETURN(range_iter_more(range->start, range->end, range->inclusive, args[1]));
 }
 
 DEFINE_NATIVE(Range_iterNext) {
@@ -872,7 +854,7 @@ DEFINE_NATIVE(List_set) {
     ObjList* list = VAL_TO_LIST(args[0]);
     uint32_t idx;
     if (value_to_index(args[1], list->size, &idx))
-        objlist_set(list, idx, args[2]);
+        objlist_set(list, vm, idx, args[2]);
     RETURN(OBJ_TO_VAL(list));
 }
 
@@ -903,8 +885,7 @@ DEFINE_NATIVE(List_length) {
 DEFINE_NATIVE(List_iterMore) {
     ARGSPEC("L*");
     ObjList* list = VAL_TO_LIST(args[0]);
-    Value rv = generic_iterMore(args[1], list->size);
-    RETURN(rv);
+    RETURN(sequence_iter_more(args[1], list->size));
 }
 
 // ============================= Map =============================
@@ -944,27 +925,45 @@ DEFINE_NATIVE(Map_delete) {
     RETURN(args[0]);
 }
 
+// Maps are iterated over in the order of their array part, then in
+// insertion order, skipping the deleted entries.
 DEFINE_NATIVE(Map_rawIterMore) {
     ARGSPEC("M*");
     ObjMap* map = VAL_TO_MAP(args[0]);
-    Value rv = generic_tableIterMore(&map->tbl, args[1]);
-    RETURN(rv);
+    objmap_finish_resize(map, vm);
+    uint32_t end = objmap_end(map);
+    uint32_t idx;
+    Entry entry;
+    if (!next_index(args[1], end, &idx))
+        RETURN(FALSE_VAL);
+    for (; idx < end; idx++)
+        if (objmap_entry_at(map, idx, &entry))
+            RETURN(NUMBER_TO_VAL(idx));
+    RETURN(FALSE_VAL);
+}
+
+static bool
+map_entry_at(VM* vm, ObjMap* map, Value value, Entry* entry)
+{
+    objmap_finish_resize(map, vm);
+    uint32_t idx;
+    if (!value_to_index(value, objmap_end(map), &idx))
+        return false;
+    return objmap_entry_at(map, idx, entry);
 }
 
 DEFINE_NATIVE(Map_rawKeyAt) {
     ARGSPEC("MN");
-    ObjMap* map = VAL_TO_MAP(args[0]);
     Entry entry;
-    if (generic_tableIterEntry(&map->tbl, args[1], &entry))
+    if (map_entry_at(vm, VAL_TO_MAP(args[0]), args[1], &entry))
         RETURN(entry.key);
     RETURN(NIL_VAL);
 }
 
 DEFINE_NATIVE(Map_rawValueAt) {
     ARGSPEC("MN");
-    ObjMap* map = VAL_TO_MAP(args[0]);
     Entry entry;
-    if (generic_tableIterEntry(&map->tbl, args[1], &entry))
+    if (map_entry_at(vm, VAL_TO_MAP(args[0]), args[1], &entry))
         RETURN(entry.value);
     RETURN(NIL_VAL);
 }
@@ -972,7 +971,7 @@ DEFINE_NATIVE(Map_rawValueAt) {
 DEFINE_NATIVE(Map_length) {
     ARGSPEC("M");
     ObjMap* map = VAL_TO_MAP(args[0]);
-    RETURN(NUMBER_TO_VAL((double) map->tbl.count));
+    RETURN(NUMBER_TO_VAL((double) objmap_length(map)));
 }
 
 // ============================= Msg =============================
@@ -1002,6 +1001,7 @@ DEFINE_NATIVE(Msg_setSlotName) {
     ARGSPEC("mS");
     ObjMsg* msg = VAL_TO_MSG(args[0]);
     msg->slot_name = VAL_TO_STRING(args[1]);
+    memory_barrier(vm, (Obj*)msg);
     RETURN(OBJ_TO_VAL(msg));
 }
 
@@ -1015,20 +1015,182 @@ DEFINE_NATIVE(Msg_setArgs) {
     ARGSPEC("mL");
     ObjMsg* msg = VAL_TO_MSG(args[0]);
     msg->args = VAL_TO_LIST(args[1]);
+    memory_barrier(vm, (Obj*)msg);
     RETURN(OBJ_TO_VAL(msg));
 }
 
+// ============================= WeakRef =============================
+
+DEFINE_NATIVE(WeakRef_new) {
+    ARGSPEC("**");
+    RETURN(OBJ_TO_VAL(objweakref_new(vm, args[1])));
+}
+
+DEFINE_NATIVE(WeakRef_get) {
+    ARGSPEC("w");
+    RETURN(VAL_TO_WEAKREF(args[0])->target);
+}
+
+// ============================= WeakMap =============================
+
+DEFINE_NATIVE(WeakMap_new) {
+    RETURN(OBJ_TO_VAL(objweakmap_new(vm)));
+}
+
+DEFINE_NATIVE(WeakMap_has) {
+    ARGSPEC("W*");
+    Value rv;
+    RETURN(BOOL_TO_VAL(objweakmap_get(VAL_TO_WEAKMAP(args[0]), args[1], &rv)));
+}
+
+DEFINE_NATIVE(WeakMap_get) {
+    ARGSPEC("W*");
+    Value rv;
+    if (!objweakmap_get(VAL_TO_WEAKMAP(args[0]), args[1], &rv))
+        rv = (num_args > 1) ? args[2] : NIL_VAL;
+    RETURN(rv);
+}
+
+DEFINE_NATIVE(WeakMap_set) {
+    ARGSPEC("W**");
+    objweakmap_set(VAL_TO_WEAKMAP(args[0]), vm, args[1], args[2]);
+    RETURN(args[0]);
+}
+
+DEFINE_NATIVE(WeakMap_delete) {
+    ARGSPEC("W*");
+    objweakmap_delete(VAL_TO_WEAKMAP(args[0]), vm, args[1]);
+    RETURN(args[0]);
+}
+
+DEFINE_NATIVE(WeakMap_length) {
+    ARGSPEC("W");
+    RETURN(NUMBER_TO_VAL((double) VAL_TO_WEAKMAP(args[0])->tbl.count));
+}
+
+// ============================= GC =============================
+
+DEFINE_NATIVE(GC_collect) {
+    memory_collect(vm);
+    RETURN(NIL_VAL);
+}
+
+DEFINE_NATIVE(GC_region) {
+    ARGSPEC("*F");
+    memory_begin_region(vm);
+    bool ok = vm_call(vm, args[1], 0);
+    memory_end_region(vm);
+    if (!ok)
+        return false;
+    // The stack may have moved, so `args` can't be used.
+    Value rv = vm_pop(vm);
+    vm_pop(vm);
+    vm_push(vm, rv);
+    return true;
+}
+
+static void
+map_set_number(VM* vm, ObjMap* map, const char* key, double value)
+{
+    Value k = OBJ_TO_VAL(CONST_STRING(vm, key));
+    vm_push_root(vm, k);
+    objmap_set(map, vm, k, NUMBER_TO_VAL(value));
+    vm_pop_root(vm);
+}
+
+static void
+map_set_map(VM* vm, ObjMap* map, const char* key, ObjMap* value)
+{
+    vm_push_root(vm, OBJ_TO_VAL(value));
+    Value k = OBJ_TO_VAL(CONST_STRING(vm, key));
+    vm_push_root(vm, k);
+    objmap_set(map, vm, k, OBJ_TO_VAL(value));
+    vm_pop_root(vm);
+    vm_pop_root(vm);
+}
+
+DEFINE_NATIVE(GC_stats) {
+    // Take the snapshot first, building the map allocates.
+    GCStats stats = vm_gc_stats(vm);
+    ObjMap* map = objmap_new(vm);
+    vm_push_root(vm, OBJ_TO_VAL(map));
+    map_set_number(vm, map, "minorCollections", stats.minor_count);
+    map_set_number(vm, map, "majorCollections", stats.major_count);
+    map_set_number(vm, map, "majorSteps",       stats.major_steps);
+    map_set_number(vm, map, "sweepSteps",       stats.sweep_steps);
+    map_set_number(vm, map, "minorTime",        stats.minor_time);
+    map_set_number(vm, map, "majorTime",        stats.major_time);
+    map_set_number(vm, map, "sweepTime",        stats.sweep_time);
+    map_set_number(vm, map, "minorMaxPause",    stats.minor_max_pause);
+    map_set_number(vm, map, "majorMaxPause",    stats.major_max_pause);
+    map_set_number(vm, map, "sweepMaxPause",    stats.sweep_max_pause);
+    map_set_number(vm, map, "minorFreed",       stats.minor_freed);
+    map_set_number(vm, map, "majorFreed",       stats.major_freed);
+    map_set_number(vm, map, "heapSize",         stats.heap_size);
+    map_set_number(vm, map, "nextCollection",   vm->next_gc);
+    map_set_number(vm, map, "allocated",        stats.bytes_allocated_total);
+    map_set_number(vm, map, "allocRate",        stats.alloc_rate);
+    map_set_number(vm, map, "survivalRate",     stats.survival_rate);
+    map_set_number(vm, map, "overhead",         stats.overhead);
+    map_set_number(vm, map, "regions",          stats.region_count);
+    map_set_number(vm, map, "regionPagesFreed", stats.region_pages_freed);
+    map_set_number(vm, map, "regionPagesPinned", stats.region_pages_pinned);
+
+    ObjMap* objects = objmap_new(vm);
+    map_set_map(vm, map, "objects", objects);
+    ObjMap* bytes = objmap_new(vm);
+    map_set_map(vm, map, "objectBytes", bytes);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        map_set_number(vm, objects, object_type_name(i), stats.objects[i]);
+        map_set_number(vm, bytes,   object_type_name(i), stats.object_bytes[i]);
+    }
+    vm_pop_root(vm); // map
+    RETURN(OBJ_TO_VAL(map));
+}
+
+// Getter and setter for a field of vm->gc_policy.
+#define DEFINE_GC_POLICY(getter, setter, field, type, valid, msg) \
+    DEFINE_NATIVE(getter) {\
+        RETURN(NUMBER_TO_VAL((double)vm->gc_policy.field));\
+    }\
+    DEFINE_NATIVE(setter) {\
+        ARGSPEC("*N");\
+        double x = VAL_TO_NUMBER(args[1]);\
+        if (!(valid))\
+            ERROR("%s expected arg 0 to be %s.", __func__, msg);\
+        GCPolicy policy = vm->gc_policy;\
+        policy.field = (type)x;\
+        memory_set_policy(vm, policy);\
+        RETURN(args[0]);\
+    }
+
+DEFINE_GC_POLICY(GC_minHeap, GC_setMinHeap, min_heap, size_t,
+                 x >= 0 && x < 1e15, "a number of bytes")
+DEFINE_GC_POLICY(GC_maxHeap, GC_setMaxHeap, max_heap, size_t,
+                 x >= 0 && x < 1e15, "a number of bytes")
+DEFINE_GC_POLICY(GC_growFactor, GC_setGrowFactor, grow_factor, double,
+                 x > 1 && x < 1e3, "a Number above 1")
+DEFINE_GC_POLICY(GC_targetOverhead, GC_setTargetOverhead, target_overhead, double,
+                 x >= 0 && x < 1, "a Number from 0 to 1")
+DEFINE_GC_POLICY(GC_targetPause, GC_setTargetPause, target_pause, double,
+                 x >= 0 && x < 1e3, "a number of seconds")
+#undef DEFINE_GC_POLICY
+
 void core_init_vm(VM* vm)
 {
-#define ADD_OBJECT(table, name, obj) (define_on_table(vm, table, name, OBJ_TO_VAL(obj)))
-#define ADD_NATIVE(table, name, fn)  (ADD_OBJECT(table, name, objnative_new(vm, fn)))
-#define ADD_METHOD(PROTO, name, fn)  (ADD_NATIVE(&vm->PROTO->slots, name, fn))
-#define ADD_VALUE(PROTO, name, v)    (define_on_table(vm, &vm->PROTO->slots, name, v))
+#define ADD_OBJECT(object, name, obj) (define_on_object(vm, object, name, OBJ_TO_VAL(obj)))
+#define ADD_NATIVE(object, name, fn)  (ADD_OBJECT(object, name, objnative_new(vm, fn)))
+#define ADD_METHOD(PROTO, name, fn)   (ADD_NATIVE(vm->PROTO, name, fn))
+#define ADD_VALUE(PROTO, name, v)     (define_on_object(vm, vm->PROTO, name, v))
 #define SET_PROTO(TARGET, PROTO)     (objobject_set_proto(vm->TARGET, vm, OBJ_TO_VAL(vm->PROTO)))
+#define ADD_INTRINSIC(type, PROTO, name) (vm_add_intrinsic(vm, type, vm->PROTO, name))
+#define ADD_GLOBAL(name, obj)        (vm_add_global(vm, name, OBJ_TO_VAL(obj)))
 
     vm->forward_string = CONST_STRING(vm, "forward");
     vm->init_string = CONST_STRING(vm, "init");
 
+    vm->root_shape = shape_new(vm, NULL, UNDEFINED_VAL);
+
     vm->ObjectProto = objobject_new(vm);
     ADD_METHOD(ObjectProto, "proto",       Object_proto);
     ADD_METHOD(ObjectProto, "setProto",    Object_setProto);
@@ -1159,16 +1321,83 @@ void core_init_vm(VM* vm)
     ADD_METHOD(MsgProto, "setSlotName", Msg_setSlotName);
     ADD_METHOD(MsgProto, "setArgs",     Msg_setArgs);
 
-    ADD_OBJECT(&vm->globals, "Object", vm->ObjectProto);
-    ADD_OBJECT(&vm->globals, "Fn",     vm->FnProto);
-    ADD_OBJECT(&vm->globals, "Native", vm->NativeProto);
-    ADD_OBJECT(&vm->globals, "Number", vm->NumberProto);
-    ADD_OBJECT(&vm->globals, "String", vm->StringProto);
-    ADD_OBJECT(&vm->globals, "Fiber",  vm->FiberProto);
-    ADD_OBJECT(&vm->globals, "Range",  vm->RangeProto);
-    ADD_OBJECT(&vm->globals, "List",   vm->ListProto);
-    ADD_OBJECT(&vm->globals, "Map",    vm->MapProto);
-    ADD_OBJECT(&vm->globals, "Msg",    vm->MsgProto);
+    vm->WeakRefProto = objobject_new(vm);
+    SET_PROTO(WeakRefProto, ObjectProto);
+    ADD_METHOD(WeakRefProto, "new", WeakRef_new);
+    ADD_METHOD(WeakRefProto, "get", WeakRef_get);
+
+    vm->WeakMapProto = objobject_new(vm);
+    SET_PROTO(WeakMapProto, ObjectProto);
+    ADD_METHOD(WeakMapProto, "new",    WeakMap_new);
+    ADD_METHOD(WeakMapProto, "has",    WeakMap_has);
+    ADD_METHOD(WeakMapProto, "get",    WeakMap_get);
+    ADD_METHOD(WeakMapProto, "set",    WeakMap_set);
+    ADD_METHOD(WeakMapProto, "delete", WeakMap_delete);
+    ADD_METHOD(WeakMapProto, "length", WeakMap_length);
+
+    ADD_INTRINSIC(INTRINSIC_NUMBER_ADD,     NumberProto, "+");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_SUB,     NumberProto, "-");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_MUL,     NumberProto, "*");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_DIV,     NumberProto, "/");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_LT,      NumberProto, "<");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_LEQ,     NumberProto, "<=");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_GT,      NumberProto, ">");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_GEQ,     NumberProto, ">=");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_EQ,      NumberProto, "==");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_NEQ,     NumberProto, "!=");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_BIT_AND, NumberProto, "&");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_BIT_OR,  NumberProto, "|");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_NEG,     NumberProto, "neg");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_NOT,     NumberProto, "!");
+    ADD_INTRINSIC(INTRINSIC_STRING_ADD,     StringProto, "+");
+    ADD_INTRINSIC(INTRINSIC_STRING_LT,      StringProto, "<");
+    ADD_INTRINSIC(INTRINSIC_STRING_LEQ,     StringProto, "<=");
+    ADD_INTRINSIC(INTRINSIC_STRING_GT,      StringProto, ">");
+    ADD_INTRINSIC(INTRINSIC_STRING_GEQ,     StringProto, ">=");
+    ADD_INTRINSIC(INTRINSIC_STRING_EQ,      StringProto, "==");
+    ADD_INTRINSIC(INTRINSIC_STRING_NEQ,     StringProto, "!=");
+    ADD_INTRINSIC(INTRINSIC_STRING_NOT,     StringProto, "!");
+    ADD_INTRINSIC(INTRINSIC_OBJECT_EQ,      ObjectProto, "==");
+    ADD_INTRINSIC(INTRINSIC_OBJECT_NEQ,     ObjectProto, "!=");
+    ADD_INTRINSIC(INTRINSIC_OBJECT_NOT,     ObjectProto, "!");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_INCLUSIVE_RANGE, NumberProto, "..");
+    ADD_INTRINSIC(INTRINSIC_NUMBER_EXCLUSIVE_RANGE, NumberProto, "...");
+    ADD_INTRINSIC(INTRINSIC_LIST_ITER_MORE,   ListProto,   "iterMore");
+    ADD_INTRINSIC(INTRINSIC_LIST_ITER_NEXT,   ListProto,   "iterNext");
+    ADD_INTRINSIC(INTRINSIC_RANGE_ITER_MORE,  RangeProto,  "iterMore");
+    ADD_INTRINSIC(INTRINSIC_RANGE_ITER_NEXT,  RangeProto,  "iterNext");
+    ADD_INTRINSIC(INTRINSIC_STRING_ITER_MORE, StringProto, "iterMore");
+    ADD_INTRINSIC(INTRINSIC_STRING_ITER_NEXT, StringProto, "iterNext");
+
+    ADD_GLOBAL("Object", vm->ObjectProto);
+    ADD_GLOBAL("Fn",     vm->FnProto);
+    ADD_GLOBAL("Native", vm->NativeProto);
+    ADD_GLOBAL("Number", vm->NumberProto);
+    ADD_GLOBAL("String", vm->StringProto);
+    ADD_GLOBAL("Fiber",  vm->FiberProto);
+    ADD_GLOBAL("Range",  vm->RangeProto);
+    ADD_GLOBAL("List",   vm->ListProto);
+    ADD_GLOBAL("Map",    vm->MapProto);
+    ADD_GLOBAL("Msg",    vm->MsgProto);
+    ADD_GLOBAL("WeakRef", vm->WeakRefProto);
+    ADD_GLOBAL("WeakMap", vm->WeakMapProto);
+
+    ObjObject* gc = objobject_new(vm);
+    ADD_GLOBAL("GC", gc);
+    objobject_set_proto(gc, vm, OBJ_TO_VAL(vm->ObjectProto));
+    ADD_NATIVE(gc, "collect",           GC_collect);
+    ADD_NATIVE(gc, "stats",             GC_stats);
+    ADD_NATIVE(gc, "region",            GC_region);
+    ADD_NATIVE(gc, "minHeap",           GC_minHeap);
+    ADD_NATIVE(gc, "setMinHeap",        GC_setMinHeap);
+    ADD_NATIVE(gc, "maxHeap",           GC_maxHeap);
+    ADD_NATIVE(gc, "setMaxHeap",        GC_setMaxHeap);
+    ADD_NATIVE(gc, "growFactor",        GC_growFactor);
+    ADD_NATIVE(gc, "setGrowFactor",     GC_setGrowFactor);
+    ADD_NATIVE(gc, "targetOverhead",    GC_targetOverhead);
+    ADD_NATIVE(gc, "setTargetOverhead", GC_setTargetOverhead);
+    ADD_NATIVE(gc, "targetPause",       GC_targetPause);
+    ADD_NATIVE(gc, "setTargetPause",    GC_setTargetPause);
 
     if (vm_interpret(vm, CORE_SOURCE) != INTERPRET_OK) {
         fprintf(stderr, "vm_interpret(CORE_SOURCE) not ok.\n");
@@ -1180,4 +1409,6 @@ void core_init_vm(VM* vm)
 #undef ADD_METHOD
 #undef ADD_VALUE
 #undef SET_PROTO
+#undef ADD_INTRINSIC
+#undef ADD_GLOBAL
 }
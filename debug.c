@@ -30,11 +30,14 @@ void debug_print_object(Obj* obj) {
         case OBJ_MAP: printf("map_%p", (void*)obj); break;
         case OBJ_MSG: printf("msg_%p", (void*)obj); break;
         case OBJ_FOREIGN: printf("foreign_%p", (void*)obj); break;
+        case OBJ_WEAKREF: printf("weakref_%p", (void*)obj); break;
+        case OBJ_WEAKMAP: printf("weakmap_%p", (void*)obj); break;
+        case OBJ_SHAPE: printf("shape_%p", (void*)obj); break;
     }
 }
 
 void debug_print_value(Value value) {
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VALUE_UNDEFINED: printf("undefined"); break;
         case VALUE_NIL: printf("nil"); break;
         case VALUE_TRUE: printf("true"); break;
@@ -64,12 +67,47 @@ static int constant_instruction(Chunk* chunk, int index, const char* name) {
     return index + 3;
 }
 
+static int short_instruction(Chunk* chunk, int index, const char* name) {
+    uint16_t value = (uint16_t)(chunk->code[index + 1] << 8);
+    value |= chunk->code[index + 2];
+    printf("%-16s %4d\n", name, value);
+    return index + 3;
+}
+
 static int byte_instruction(Chunk* chunk, int index, const char* name) {
     uint8_t byte = (uint8_t)(chunk->code[index + 1]);
     printf("%-16s %4d\n", name, byte);
     return index + 2;
 }
 
+static int operator_instruction(Chunk* chunk, int index, const char* name) {
+    uint16_t constant = (uint16_t)(chunk->code[index + 1] << 8);
+    constant |= chunk->code[index + 2];
+    uint16_t cache = (uint16_t)(chunk->code[index + 3] << 8);
+    cache |= chunk->code[index + 4];
+    printf("%-16s %4d ", name, constant);
+    debug_print_value(chunk->constants.values[constant]);
+    printf(" [ic %u]\n", cache);
+    return index + 5;
+}
+
+// The OP_RANGE* instructions have an inclusive flag (and a slot)
+// followed by the operands of an operator instruction.
+static int range_instruction(Chunk* chunk, int index, bool has_slot, const char* name) {
+    int operands = index + (has_slot ? 3 : 2);
+    uint16_t constant = (uint16_t)(chunk->code[operands] << 8);
+    constant |= chunk->code[operands + 1];
+    uint16_t cache = (uint16_t)(chunk->code[operands + 2] << 8);
+    cache |= chunk->code[operands + 3];
+    printf("%-16s %s", name, chunk->code[index + 1] ? ".." : "...");
+    if (has_slot)
+        printf(" %d", chunk->code[index + 2]);
+    printf(" ");
+    debug_print_value(chunk->constants.values[constant]);
+    printf(" [ic %u]\n", cache);
+    return operands + 4;
+}
+
 static int
 jump_instruction(Chunk* chunk, int index, int direction, const char* name)
 {
@@ -94,9 +132,9 @@ int debug_print_instruction(Chunk* chunk, int index) {
         case OP_TRUE:     return simple_instruction(index, "OP_TRUE");
         case OP_FALSE:    return simple_instruction(index, "OP_FALSE");
         case OP_NIL:      return simple_instruction(index, "OP_NIL");
-        case OP_DEF_GLOBAL: return constant_instruction(chunk, index, "OP_DEF_GLOBAL");
-        case OP_GET_GLOBAL: return constant_instruction(chunk, index, "OP_GET_GLOBAL");
-        case OP_SET_GLOBAL: return constant_instruction(chunk, index, "OP_SET_GLOBAL");
+        case OP_DEF_GLOBAL: return short_instruction(chunk, index, "OP_DEF_GLOBAL");
+        case OP_GET_GLOBAL: return short_instruction(chunk, index, "OP_GET_GLOBAL");
+        case OP_SET_GLOBAL: return short_instruction(chunk, index, "OP_SET_GLOBAL");
         case OP_ASSERT: return simple_instruction(index, "OP_ASSERT");
         case OP_GET_LOCAL:  return byte_instruction(chunk, index, "OP_GET_LOCAL");
         case OP_SET_LOCAL:  return byte_instruction(chunk, index, "OP_SET_LOCAL");
@@ -129,15 +167,37 @@ int debug_print_instruction(Chunk* chunk, int index) {
         case OP_OBJLIT_SET: return constant_instruction(chunk, index, "OP_OBJLIT_SET");
         case OP_INVOKE: {
             index++;
+            uint8_t num_args = chunk->code[index++];
             uint16_t constant = (uint16_t)(chunk->code[index++] << 8);
             constant |= chunk->code[index++];
             printf("%-16s %4d ", "OP_INVOKE", constant);
             debug_print_value(chunk->constants.values[constant]);
-            uint8_t num_args = chunk->code[index++];
             printf(" (%u args)", num_args);
+            uint16_t cache = (uint16_t)(chunk->code[index++] << 8);
+            cache |= chunk->code[index++];
+            printf(" [ic %u]", cache);
             printf("\n");
             return index;
         }
+        case OP_ADD:     return operator_instruction(chunk, index, "OP_ADD");
+        case OP_SUB:     return operator_instruction(chunk, index, "OP_SUB");
+        case OP_MUL:     return operator_instruction(chunk, index, "OP_MUL");
+        case OP_DIV:     return operator_instruction(chunk, index, "OP_DIV");
+        case OP_LT:      return operator_instruction(chunk, index, "OP_LT");
+        case OP_LEQ:     return operator_instruction(chunk, index, "OP_LEQ");
+        case OP_GT:      return operator_instruction(chunk, index, "OP_GT");
+        case OP_GEQ:     return operator_instruction(chunk, index, "OP_GEQ");
+        case OP_EQ:      return operator_instruction(chunk, index, "OP_EQ");
+        case OP_NEQ:     return operator_instruction(chunk, index, "OP_NEQ");
+        case OP_BIT_AND: return operator_instruction(chunk, index, "OP_BIT_AND");
+        case OP_BIT_OR:  return operator_instruction(chunk, index, "OP_BIT_OR");
+        case OP_NEG:     return operator_instruction(chunk, index, "OP_NEG");
+        case OP_NOT:     return operator_instruction(chunk, index, "OP_NOT");
+        case OP_ITER_MORE: return operator_instruction(chunk, index, "OP_ITER_MORE");
+        case OP_ITER_NEXT: return operator_instruction(chunk, index, "OP_ITER_NEXT");
+        case OP_RANGE:      return range_instruction(chunk, index, false, "OP_RANGE");
+        case OP_RANGE_MORE: return range_instruction(chunk, index, true, "OP_RANGE_MORE");
+        case OP_RANGE_NEXT: return range_instruction(chunk, index, true, "OP_RANGE_NEXT");
         default:
             printf("Unknown instruction.\n");
             return index + 1;
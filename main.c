@@ -75,6 +75,10 @@ int main(int argc, const char* argv[]) {
     core_init_vm(&vm);
     ext_io_init_vm(&vm);
 
+    const char* gc_threads = getenv("SUBTLE_GC_THREADS");
+    if (gc_threads != NULL)
+        vm.gc_threads = atoi(gc_threads);
+
     if (argc == 1) {
         repl(&vm);
     } else if (argc == 2) {
@@ -10,19 +10,90 @@
 #include <malloc.h> // malloc_trim
 #endif
 
+#include <pthread.h>
 #include <stdio.h>   // perror
-#include <stdlib.h>  // realloc, free
+#include <stdlib.h>  // realloc, calloc, free
+#include <string.h>  // memset
+#include <sys/mman.h> // mmap, munmap
+#include <time.h>    // clock_gettime
 
+// Incremental collections are finished at once if the heap grows this
+// much past vm->next_gc.
 #define GC_HEAP_GROW_FACTOR 2
+// Most the heap grows by between two full collections, to meet the
+// policy's target_overhead.
+#define GC_MAX_GROW_FACTOR 8
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void record_pause(double* total, double* max, double start) {
+    double pause = now() - start;
+    *total += pause;
+    if (pause > *max) *max = pause;
+}
 
-void* memory_realloc(VM* vm, void* ptr, size_t old_size, size_t new_size) {
-    vm->bytes_allocated += new_size - old_size;
-    if (new_size > old_size) {
 #ifdef SUBTLE_DEBUG_STRESS_GC
-        memory_collect(vm);
+// Mostly minor collections and small incremental steps, to shake out
+// missing barriers. Sweeping is interleaved with minor collections.
+// Regions put minor collections off, as usual.
+static void stress_collect(VM* vm) {
+    GCStats* stats = &vm->gc_stats;
+    if (vm->gc_phase == GC_MARKING
+            || (vm->gc_phase == GC_SWEEPING && stats->minor_count % 2 == 0)) {
+        size_t work = vm->gc_step_work;
+        vm->gc_step_work = 8;
+        memory_step(vm);
+        vm->gc_step_work = work;
+    } else if (vm->gc_phase == GC_IDLE
+               && (stats->minor_count + stats->major_count) % 8 == 0) {
+        memory_start_collect(vm);
+    } else if (vm->region_depth == 0) {
+        memory_collect_young(vm);
+    }
+}
+#endif
+
+// Runs the collector if it's due, before allocating.
+static void collect_if_needed(VM* vm) {
+#ifdef SUBTLE_DEBUG_STRESS_GC
+    stress_collect(vm);
 #endif
-        if (vm->bytes_allocated > vm->next_gc)
+    if (vm->gc_phase == GC_MARKING) {
+        // Finish the collection right away if marking falls too
+        // far behind the program.
+        if (vm->bytes_allocated > vm->next_gc * GC_HEAP_GROW_FACTOR)
             memory_collect(vm);
+        else if (vm->bytes_allocated > vm->next_gc_step)
+            memory_step(vm);
+    } else if (vm->gc_phase == GC_IDLE
+               && vm->bytes_allocated > vm->next_gc) {
+#ifdef SUBTLE_NO_INCREMENTAL_GC
+        memory_collect(vm);
+#else
+        memory_start_collect(vm);
+#endif
+    } else {
+        // Sweeping happens alongside minor collections.
+        if (vm->gc_phase == GC_SWEEPING
+                && vm->bytes_allocated > vm->next_gc_step)
+            memory_step(vm);
+#ifndef SUBTLE_NO_GENERATIONAL_GC
+        // They couldn't free anything in a region.
+        if (vm->bytes_allocated > vm->next_minor_gc && vm->region_depth == 0)
+            memory_collect_young(vm);
+#endif
+    }
+}
+
+void* memory_realloc(VM* vm, void* ptr, size_t old_size, size_t new_size) {
+    vm->bytes_allocated += new_size - old_size;
+    if (new_size > old_size) {
+        vm->gc_stats.bytes_allocated_total += new_size - old_size;
+        collect_if_needed(vm);
     }
 
     if (new_size == 0) {
@@ -38,19 +109,346 @@ void* memory_realloc(VM* vm, void* ptr, size_t old_size, size_t new_size) {
     return result;
 }
 
-void mark_object(VM* vm, Obj* obj) {
-    if (obj == NULL) return;
-    if (obj->marked) return; // don't mark cycles forever
+// Like memory_realloc(vm, NULL, 0, size), but zeroed. Large blocks
+// come zeroed from the OS, so this doesn't have to touch them.
+void* memory_calloc(VM* vm, size_t size) {
+    vm->bytes_allocated += size;
+    vm->gc_stats.bytes_allocated_total += size;
+    collect_if_needed(vm);
+    void* result = calloc(1, size);
+    if (result == NULL) {
+        perror("memory_calloc");
+        exit(1);
+    }
+    return result;
+}
 
-#ifdef SUBTLE_DEBUG_TRACE_ALLOC
-    printf("%p mark ", (void*)obj);
-    debug_print_value(OBJ_TO_VAL(obj));
-    printf("\n");
+// Object allocator
+// ================
+//
+// Objects are allocated from SLAB_PAGE_SIZE pages, and each page holds
+// slots of a single size class (a multiple of SLAB_GRANULE bytes).
+// Pages are aligned to their size, so an object's page can be found
+// from its address.
+
+#define SLAB_HEADER_SIZE \
+    ((sizeof(SlabPage) + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE)
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_SIZE / SLAB_GRANULE / 64)
+
+static inline char* page_slot(SlabPage* page, uint32_t i) {
+    return (char*)page + SLAB_HEADER_SIZE + (size_t)i * page->slot_size;
+}
+
+static inline void bitmap_set(uint64_t* bitmap, uint32_t i) {
+    bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void bitmap_clear(uint64_t* bitmap, uint32_t i) {
+    bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static inline int size_class_of(size_t size) {
+    return (int)((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+}
+
+// Region pages are bumped into instead of having a free list, and
+// they're on vm->region_pages instead of cls->pages.
+// Pages are cut out of chunks of SLAB_CHUNK_PAGES pages, mapped at
+// once and aligned by unmapping the excess (aligned_alloc leaves up to
+// a page of padding next to each one). Emptied pages are kept on
+// vm->free_pages for reuse, up to SLAB_FREE_PAGES of them, and
+// unmapped otherwise.
+#define SLAB_CHUNK_PAGES 64
+#define SLAB_FREE_PAGES  64
+
+static void* page_alloc(VM* vm) {
+    if (vm->free_pages != NULL) {
+        SlabPage* page = vm->free_pages;
+        vm->free_pages = page->next;
+        vm->free_pages_count--;
+        return page;
+    }
+    if (vm->page_chunk_left == 0) {
+        size_t size = (SLAB_CHUNK_PAGES + 1) * SLAB_PAGE_SIZE;
+        char* chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            perror("page_alloc");
+            exit(1);
+        }
+        size_t head = -(uintptr_t)chunk & (SLAB_PAGE_SIZE - 1);
+        if (head > 0)
+            munmap(chunk, head);
+        munmap(chunk + head + SLAB_CHUNK_PAGES * SLAB_PAGE_SIZE,
+               SLAB_PAGE_SIZE - head);
+        vm->page_chunk = chunk + head;
+        vm->page_chunk_left = SLAB_CHUNK_PAGES;
+    }
+    void* page = vm->page_chunk;
+    vm->page_chunk += SLAB_PAGE_SIZE;
+    vm->page_chunk_left--;
+    return page;
+}
+
+static void page_release(VM* vm, SlabPage* page) {
+    if (vm->free_pages_count < SLAB_FREE_PAGES) {
+        page->next = vm->free_pages;
+        vm->free_pages = page;
+        vm->free_pages_count++;
+        return;
+    }
+    munmap(page, SLAB_PAGE_SIZE);
+}
+
+static SlabPage* page_new(VM* vm, int size_class, bool region) {
+    SlabPage* page = page_alloc(vm);
+    page->slot_size = (size_class + 1) * SLAB_GRANULE;
+    page->slot_count = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / page->slot_size;
+    page->used = 0;
+    page->sweep_epoch = vm->sweep_epoch;
+    page->size_class = size_class;
+    page->available = false;
+    page->young = false;
+    page->region = region;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    memset(page->marks, 0, sizeof(page->marks));
+    page->free = NULL;
+    if (region) {
+        page->next = vm->region_pages;
+        vm->region_pages = page;
+        return page;
+    }
+    // Thread the free list in address order.
+    for (uint32_t i = page->slot_count; i-- > 0;) {
+        void** slot = (void**)page_slot(page, i);
+        *slot = page->free;
+        page->free = slot;
+    }
+    SizeClass* cls = &vm->size_classes[size_class];
+    page->next = cls->pages;
+    cls->pages = page;
+    return page;
+}
+
+static void make_available(SizeClass* cls, SlabPage* page) {
+    if (page->available) return;
+    page->available = true;
+    page->next_available = cls->available;
+    cls->available = page;
+}
+
+static size_t sweep_page(VM* vm, SizeClass* cls, SlabPage* page);
+
+static void* slab_alloc(VM* vm, int size_class) {
+    SizeClass* cls = &vm->size_classes[size_class];
+    SlabPage* page;
+    for (;;) {
+        page = cls->available;
+        if (page == NULL) {
+            // Sweep the pages of this size class on demand, before
+            // asking for a new one.
+            if (cls->unswept != NULL) {
+                GCStats* stats = &vm->gc_stats;
+                double start = now();
+                SlabPage* unswept = cls->unswept;
+                cls->unswept = unswept->next;
+                sweep_page(vm, cls, unswept);
+                stats->sweep_steps++;
+                record_pause(&stats->sweep_time, &stats->sweep_max_pause, start);
+                continue;
+            }
+            page = page_new(vm, size_class, false);
+            make_available(cls, page);
+        }
+        if (page->free != NULL)
+            break;
+        cls->available = page->next_available;
+        page->available = false;
+    }
+    void** slot = page->free;
+    page->free = *slot;
+    // New objects start out unmarked, i.e. young.
+    uint32_t i = page_granule(page, slot);
+    bitmap_set(page->allocated, i);
+    bitmap_clear(page->marks, i);
+    page->used++;
+    if (!page->young) {
+        page->young = true;
+        page->next_young = vm->young_pages;
+        vm->young_pages = page;
+    }
+    return slot;
+}
+
+// Objects in a region are young until it ends, but they aren't on
+// vm->young_pages: only memory_end_region frees them.
+static void* region_alloc(VM* vm, int size_class) {
+    SizeClass* cls = &vm->size_classes[size_class];
+    SlabPage* page = cls->region;
+    if (page == NULL || page->used == page->slot_count)
+        cls->region = page = page_new(vm, size_class, true);
+    void* slot = page_slot(page, page->used++);
+    bitmap_set(page->allocated, page_granule(page, slot));
+    return slot;
+}
+
+static void slab_free(VM* vm, void* ptr) {
+    SlabPage* page = page_of(ptr);
+    bitmap_clear(page->allocated, page_granule(page, ptr));
+    page->used--;
+#ifdef SUBTLE_DEBUG
+    // Make use-after-frees easier to spot.
+    memset(ptr, 0xdb, page->slot_size);
 #endif
+    void** slot = ptr;
+    *slot = page->free;
+    page->free = slot;
+    // Unswept pages are made available once they're swept, and
+    // region pages once they're pinned.
+    if (page->sweep_epoch == vm->sweep_epoch && !page->region)
+        make_available(&vm->size_classes[page->size_class], page);
+}
+
+void* memory_allocate_object(VM* vm, ObjType type, size_t size) {
+    ASSERT(size <= SLAB_MAX_SIZE, "object too large for the slab allocator");
+    int size_class = size_class_of(size);
+    size_t slot_size = (size_class + 1) * SLAB_GRANULE;
+    GCStats* stats = &vm->gc_stats;
+    vm->bytes_allocated += slot_size;
+    stats->bytes_allocated_total += slot_size;
+    stats->objects[type]++;
+    stats->object_bytes[type] += slot_size;
+    collect_if_needed(vm);
+    if (vm->region_depth > 0)
+        return region_alloc(vm, size_class);
+    return slab_alloc(vm, size_class);
+}
+
+void memory_free_object(VM* vm, void* ptr, size_t size) {
+    size_t slot_size = (size_class_of(size) + 1) * SLAB_GRANULE;
+    ObjType type = ((Obj*)ptr)->type;
+    vm->bytes_allocated -= slot_size;
+    vm->gc_stats.objects[type]--;
+    vm->gc_stats.object_bytes[type] -= slot_size;
+    slab_free(vm, ptr);
+}
 
-    /* ASSERT(!obj->visited, "obj->visited"); */
-    obj->marked = true;
+// Frees the unmarked objects in `page`. Returns the number of bytes
+// freed, including the memory they owned.
+static size_t page_free_unmarked(VM* vm, SlabPage* page, bool young) {
+    size_t bytes = vm->bytes_allocated;
+    for (int w = 0; w < SLAB_BITMAP_WORDS; w++) {
+        // object_free clears bits in `allocated` as it goes.
+        uint64_t dead = page->allocated[w] & ~page->marks[w];
+        while (dead != 0) {
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            Obj* obj = (Obj*)((char*)page + ((size_t)w * 64 + bit) * SLAB_GRANULE);
+            // Taking dead young strings out of the interning table one
+            // by one beats scanning the whole table for a minor
+            // collection. Old ones are gone already, see finish_marking.
+            if (young && obj->type == OBJ_STRING)
+                table_remove_key(&vm->strings, OBJ_TO_VAL(obj));
+            object_free(obj, vm);
+        }
+    }
+    return bytes - vm->bytes_allocated;
+}
 
+void memory_free_objects(VM* vm) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        SizeClass* cls = &vm->size_classes[i];
+        SlabPage* lists[] = { cls->pages, cls->unswept };
+        for (int j = 0; j < 2; j++) {
+            SlabPage* page = lists[j];
+            while (page != NULL) {
+                SlabPage* next = page->next;
+                memset(page->marks, 0, sizeof(page->marks));
+                page_free_unmarked(vm, page, false);
+                page_release(vm, page);
+                page = next;
+            }
+        }
+        cls->pages = NULL;
+        cls->unswept = NULL;
+        cls->available = NULL;
+        cls->region = NULL;
+    }
+    vm->young_pages = NULL;
+    SlabPage* page = vm->region_pages;
+    while (page != NULL) {
+        SlabPage* next = page->next;
+        memset(page->marks, 0, sizeof(page->marks));
+        page_free_unmarked(vm, page, false);
+        page_release(vm, page);
+        page = next;
+    }
+    vm->region_pages = NULL;
+    while (vm->free_pages != NULL) {
+        SlabPage* next = vm->free_pages->next;
+        munmap(vm->free_pages, SLAB_PAGE_SIZE);
+        vm->free_pages = next;
+    }
+    vm->free_pages_count = 0;
+    if (vm->page_chunk_left > 0)
+        munmap(vm->page_chunk, (size_t)vm->page_chunk_left * SLAB_PAGE_SIZE);
+    vm->page_chunk_left = 0;
+}
+
+// Parallel marking
+// ================
+//
+// With vm->gc_threads > 1, full collections drain the gray stack with
+// that many threads (the calling one included). Each thread has its
+// own gray stack. A thread with plenty of work while others are idle
+// hands half of its stack over to a shared pool, which idle threads
+// take work from. A thread claims an object by atomically OR-ing its
+// bit into the word of its page's mark bitmap, which the bits of other
+// objects share. Only the thread that saw the bit clear goes on to
+// blacken it.
+
+// Threads only share work once they have more than this.
+#define MARK_SHARE_THRESHOLD 64
+// Most gray objects a thread takes from the pool at once.
+#define MARK_TAKE_CHUNK 256
+
+typedef struct {
+    Obj** stack;
+    int count;
+    int capacity;
+} GrayStack;
+
+typedef struct {
+    VM* vm;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GrayStack shared;
+    int threads;
+    int idle;  // Threads waiting for work in the shared pool.
+    bool done;
+} MarkPool;
+
+typedef struct {
+    MarkPool* pool;
+    GrayStack gray;
+} Marker;
+
+// The current thread's Marker, while marking in parallel.
+static _Thread_local Marker* current_marker = NULL;
+
+static void graystack_push(GrayStack* gray, Obj* obj) {
+    if (gray->count + 1 > gray->capacity) {
+        gray->capacity = GROW_CAPACITY(gray->capacity);
+        gray->stack = (Obj**) realloc(gray->stack, sizeof(Obj*) * gray->capacity);
+        if (gray->stack == NULL) {
+            perror("graystack_push: cannot allocate stack");
+            exit(1);
+        }
+    }
+    gray->stack[gray->count++] = obj;
+}
+
+static void gray_push(VM* vm, Obj* obj) {
     // Make space in the gray stack.
     if (vm->gray_count + 1 > vm->gray_capacity) {
         vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
@@ -66,6 +464,76 @@ void mark_object(VM* vm, Obj* obj) {
     vm->gray_stack[vm->gray_count++] = obj;
 }
 
+void mark_object(VM* vm, Obj* obj) {
+    if (obj == NULL) return;
+    SlabPage* page = page_of(obj);
+    uint32_t i = page_granule(page, obj);
+    uint64_t* word = &page->marks[i / 64];
+    uint64_t bit = (uint64_t)1 << (i % 64);
+
+    if (current_marker != NULL) {
+        // Other threads may be marking objects in the same word.
+        if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+                || (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit))
+            return;
+        graystack_push(&current_marker->gray, obj);
+        return;
+    }
+
+    // Don't mark cycles forever. This also skips old objects during
+    // a minor collection, since they stay marked.
+    if (*word & bit) return;
+
+#ifdef SUBTLE_DEBUG_TRACE_ALLOC
+    printf("%p mark ", (void*)obj);
+    debug_print_value(OBJ_TO_VAL(obj));
+    printf("\n");
+#endif
+
+    *word |= bit;
+    gray_push(vm, obj);
+}
+
+void memory_remember(VM* vm, Obj* obj) {
+    if (vm->remembered_count + 1 > vm->remembered_capacity) {
+        vm->remembered_capacity = GROW_CAPACITY(vm->remembered_capacity);
+        vm->remembered = (Obj**) realloc(
+            vm->remembered,
+            sizeof(Obj*) * vm->remembered_capacity);
+        if (vm->remembered == NULL) {
+            perror("memory_remember: cannot allocate remembered");
+            exit(1);
+        }
+    }
+    obj->remembered = true;
+    vm->remembered[vm->remembered_count++] = obj;
+}
+
+static void forget_remembered(VM* vm) {
+    for (int i = 0; i < vm->remembered_count; i++) {
+        Obj* obj = vm->remembered[i];
+        obj->remembered = false;
+        if (obj->type == OBJ_LIST)
+            ((ObjList*)obj)->dirty = UINT32_MAX;
+    }
+    vm->remembered_count = 0;
+}
+
+static void mark_remembered(VM* vm) {
+    for (int i = 0; i < vm->remembered_count; i++) {
+        Obj* obj = vm->remembered[i];
+        if (!is_marked(vm, obj)) {
+            mark_object(vm, obj); // See memory_barrier_value.
+        } else if (obj->type == OBJ_LIST) {
+            ObjList* list = (ObjList*)obj;
+            for (uint32_t j = list->dirty; j < list->size; j++)
+                mark_value(vm, list->values[j]);
+        } else {
+            gray_push(vm, obj);
+        }
+    }
+}
+
 void mark_value(VM* vm, Value value) {
     if (IS_OBJ(value)) mark_object(vm, VAL_TO_OBJ(value));
 }
@@ -93,8 +561,19 @@ static void mark_roots(VM* vm) {
     mark_object(vm, (Obj*)vm->ListProto);
     mark_object(vm, (Obj*)vm->MapProto);
     mark_object(vm, (Obj*)vm->MsgProto);
+    mark_object(vm, (Obj*)vm->WeakRefProto);
+    mark_object(vm, (Obj*)vm->WeakMapProto);
+    mark_object(vm, (Obj*)vm->root_shape);
+
+    // Mark the intrinsics
+    for (int i = 0; i < INTRINSIC_COUNT; i++) {
+        mark_object(vm, (Obj*)vm->intrinsics[i].proto);
+        mark_object(vm, (Obj*)vm->intrinsics[i].name);
+        mark_object(vm, (Obj*)vm->intrinsics[i].native);
+    }
 
-    table_mark(&vm->globals, vm);
+    table_mark(&vm->global_names, vm);
+    valuearray_mark(&vm->global_values, vm);
     compiler_mark(vm->compiler, vm);
 
     // Mark the handles
@@ -102,6 +581,39 @@ static void mark_roots(VM* vm) {
         mark_value(vm, h->value);
 }
 
+static void weak_push(VM* vm, Obj* obj) {
+    // Marking threads share vm->weak.
+    MarkPool* pool = current_marker != NULL ? current_marker->pool : NULL;
+    if (pool != NULL) pthread_mutex_lock(&pool->lock);
+    if (vm->weak_count + 1 > vm->weak_capacity) {
+        vm->weak_capacity = GROW_CAPACITY(vm->weak_capacity);
+        vm->weak = (Obj**) realloc(vm->weak, sizeof(Obj*) * vm->weak_capacity);
+        if (vm->weak == NULL) {
+            perror("weak_push: cannot allocate weak");
+            exit(1);
+        }
+    }
+    vm->weak[vm->weak_count++] = obj;
+    if (pool != NULL) pthread_mutex_unlock(&pool->lock);
+}
+
+// Marks the values of the entries whose keys are marked.
+static void mark_entries(VM* vm, Entry* entries, uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++) {
+        mark_value(vm, entries[i].key);
+        mark_value(vm, entries[i].value);
+    }
+}
+
+static void mark_ephemerons(VM* vm, ObjWeakMap* map) {
+    for (uint32_t i = 0; i < map->tbl.capacity; i++) {
+        Entry* entry = &map->tbl.entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
+        if (!IS_OBJ(entry->key) || is_marked(vm, VAL_TO_OBJ(entry->key)))
+            mark_value(vm, entry->value);
+    }
+}
+
 static void blacken_fiber(VM* vm, ObjFiber* fiber);
 
 static void blacken_object(VM* vm, Obj* obj) {
@@ -134,6 +646,11 @@ static void blacken_object(VM* vm, Obj* obj) {
             ObjObject* object = (ObjObject*)obj;
             for (int i = 0; i < object->protos_count; i++)
                 mark_value(vm, object->protos[i]);
+            if (object->shape != NULL) {
+                mark_object(vm, (Obj*)object->shape);
+                for (uint32_t i = 0; i < object->shape->count; i++)
+                    mark_value(vm, object->values[i]);
+            }
             table_mark(&object->slots, vm);
             break;
         }
@@ -149,7 +666,18 @@ static void blacken_object(VM* vm, Obj* obj) {
         }
         case OBJ_MAP: {
             ObjMap* map = (ObjMap*)obj;
-            table_mark(&map->tbl, vm);
+            for (uint32_t i = 0; i < map->array_length; i++)
+                mark_value(vm, map->array[i]);
+            if (map->resize == NULL) {
+                mark_entries(vm, map->entries, 0, map->length);
+            } else {
+                // The entries kept for the old ones are only set as
+                // those are moved over (or deleted), see map_resize.
+                MapResize* resize = map->resize;
+                mark_entries(vm, map->entries, 0, resize->moved);
+                mark_entries(vm, map->entries, resize->kept, map->length);
+                mark_entries(vm, resize->entries, resize->next, resize->length);
+            }
             break;
         }
         case OBJ_MSG: {
@@ -163,6 +691,25 @@ static void blacken_object(VM* vm, Obj* obj) {
             mark_value(vm, f->proto);
             break;
         }
+        case OBJ_WEAKREF:
+            // The target is left alone, see clear_weak.
+            weak_push(vm, obj);
+            break;
+        case OBJ_WEAKMAP:
+            // Values whose keys aren't marked yet have to wait, see
+            // trace_ephemerons. Marking threads leave them all to it.
+            if (current_marker == NULL)
+                mark_ephemerons(vm, (ObjWeakMap*)obj);
+            weak_push(vm, obj);
+            break;
+        case OBJ_SHAPE: {
+            // The transitions are weak, see shape_remove_white.
+            Shape* shape = (Shape*)obj;
+            mark_object(vm, (Obj*)shape->parent);
+            for (uint32_t i = 0; i < shape->count; i++)
+                mark_value(vm, shape->keys[i]);
+            break;
+        }
     }
 }
 
@@ -187,56 +734,543 @@ blacken_fiber(VM* vm, ObjFiber* fiber)
     mark_object(vm, (Obj*)fiber->parent);
 }
 
-static void trace_references(VM* vm) {
+// Roughly the number of values blacken_object looks at.
+static size_t blacken_cost(Obj* obj) {
+    switch (obj->type) {
+        case OBJ_FN:     return 1 + ((ObjFn*)obj)->chunk.constants.length;
+        case OBJ_OBJECT: {
+            ObjObject* object = (ObjObject*)obj;
+            return 1 + object->protos_count + object->values_capacity
+                     + object->slots.capacity;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)obj;
+            return 1 + (fiber->stack_top - fiber->stack) + fiber->frames_count;
+        }
+        case OBJ_LIST:   return 1 + ((ObjList*)obj)->size;
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*)obj;
+            size_t cost = 1 + objmap_end(map);
+            if (map->resize != NULL)
+                cost += map->resize->length - map->resize->next;
+            return cost;
+        }
+        case OBJ_WEAKMAP: return 1 + ((ObjWeakMap*)obj)->tbl.capacity;
+        default:         return 1;
+    }
+}
+
+// Blackens gray objects until about `work` values have been looked
+// at. Returns true if there are none left.
+static bool trace_references(VM* vm, size_t work) {
     while (vm->gray_count > 0) {
         Obj* obj = vm->gray_stack[--vm->gray_count];
+        size_t cost = blacken_cost(obj);
         blacken_object(vm, obj);
+        if (cost >= work)
+            return vm->gray_count == 0;
+        work -= cost;
     }
+    return true;
+}
+
+// Moves the bottom half of the thread's gray stack to the pool.
+static void mark_share(Marker* marker) {
+    MarkPool* pool = marker->pool;
+    GrayStack* gray = &marker->gray;
+    int half = gray->count / 2;
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < half; i++)
+        graystack_push(&pool->shared, gray->stack[i]);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = half; i < gray->count; i++)
+        gray->stack[i - half] = gray->stack[i];
+    gray->count -= half;
 }
 
-static void sweep(VM* vm) {
-    Obj* prev = NULL;
-    Obj* curr = vm->objects;
-    while (curr != NULL) {
-        if (curr->marked) {
-            curr->marked = false;
-            prev = curr;
-            curr = curr->next;
+// Takes work from the pool, waiting for some if there isn't any.
+// Returns false once every thread has run out.
+static bool mark_take(Marker* marker) {
+    MarkPool* pool = marker->pool;
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+    while (pool->shared.count == 0 && !pool->done) {
+        if (pool->idle == pool->threads) {
+            pool->done = true;
+            pthread_cond_broadcast(&pool->cond);
         } else {
-            Obj* unreached = curr;
-            curr = curr->next;
-            if (prev == NULL) {
-                vm->objects = curr;
-            } else {
-                prev->next = curr;
-            }
-            object_free(unreached, vm);
+            pthread_cond_wait(&pool->cond, &pool->lock);
         }
     }
+    bool found = pool->shared.count > 0;
+    if (found) {
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+        int n = pool->shared.count < MARK_TAKE_CHUNK
+            ? pool->shared.count
+            : MARK_TAKE_CHUNK;
+        for (int i = 0; i < n; i++)
+            graystack_push(&marker->gray, pool->shared.stack[--pool->shared.count]);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return found;
 }
 
-void memory_collect(VM* vm) {
+static void* mark_thread(void* arg) {
+    Marker* marker = arg;
+    MarkPool* pool = marker->pool;
+    current_marker = marker;
+    do {
+        GrayStack* gray = &marker->gray;
+        while (gray->count > 0) {
+            Obj* obj = gray->stack[--gray->count];
+            blacken_object(pool->vm, obj);
+            if (gray->count > MARK_SHARE_THRESHOLD
+                    && __atomic_load_n(&pool->idle, __ATOMIC_RELAXED) > 0)
+                mark_share(marker);
+        }
+    } while (mark_take(marker));
+    current_marker = NULL;
+    return NULL;
+}
+
+// Blackens every gray object, with vm->gc_threads threads.
+static void trace_parallel(VM* vm) {
+    int threads = vm->gc_threads;
+    MarkPool pool;
+    pool.vm = vm;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.threads = threads;
+    pool.idle = 0;
+    pool.done = false;
+    // The roots found so far are split between the threads.
+    pool.shared = (GrayStack){ vm->gray_stack, vm->gray_count, vm->gray_capacity };
+    vm->gray_stack = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+
+    Marker* markers = malloc(sizeof(Marker) * threads);
+    pthread_t* ids = malloc(sizeof(pthread_t) * threads);
+    if (markers == NULL || ids == NULL) {
+        perror("trace_parallel");
+        exit(1);
+    }
+    int started = 1;
+    for (int i = 0; i < threads; i++)
+        markers[i] = (Marker){ &pool, { NULL, 0, 0 } };
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&ids[i], NULL, mark_thread, &markers[i]) != 0) {
+            // Make do with the threads we have.
+            pthread_mutex_lock(&pool.lock);
+            pool.threads = started;
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        started++;
+    }
+    mark_thread(&markers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(ids[i], NULL);
+
+    for (int i = 0; i < threads; i++)
+        free(markers[i].gray.stack);
+    free(markers);
+    free(ids);
+    // Keep the (now empty) shared stack as the gray stack.
+    vm->gray_stack = pool.shared.stack;
+    vm->gray_capacity = pool.shared.capacity;
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+}
+
+// Blackens every gray object.
+static void trace_all(VM* vm) {
+    if (vm->gc_threads > 1)
+        trace_parallel(vm);
+    else
+        trace_references(vm, SIZE_MAX);
+}
+
+// Marks the values of weak map entries whose keys turned out to be
+// alive, and everything they lead to, until there are no more. Only
+// full collections mark with several threads.
+static void trace_ephemerons(VM* vm, bool full) {
+    for (;;) {
+        for (int i = 0; i < vm->weak_count; i++)
+            if (vm->weak[i]->type == OBJ_WEAKMAP)
+                mark_ephemerons(vm, (ObjWeakMap*)vm->weak[i]);
+        if (vm->gray_count == 0)
+            return;
+        if (full)
+            trace_all(vm);
+        else
+            trace_references(vm, SIZE_MAX);
+    }
+}
+
+// Once everything alive has been marked, clears the weak references
+// to unmarked objects, and the weak map entries with unmarked keys.
+static void clear_weak(VM* vm) {
+    for (int i = 0; i < vm->weak_count; i++) {
+        Obj* obj = vm->weak[i];
+        if (obj->type == OBJ_WEAKREF) {
+            ObjWeakRef* ref = (ObjWeakRef*)obj;
+            if (IS_OBJ(ref->target) && !is_marked(vm, VAL_TO_OBJ(ref->target)))
+                ref->target = NIL_VAL;
+        } else {
+            table_remove_white(&((ObjWeakMap*)obj)->tbl, vm);
+        }
+    }
+    vm->weak_count = 0;
+}
+
+// Frees the unmarked young objects. The rest become old, which
+// only means that their pages are not on vm->young_pages anymore.
+// Returns the number of bytes freed.
+static size_t sweep_young(VM* vm) {
+    size_t freed = 0;
+    SlabPage* page = vm->young_pages;
+    while (page != NULL) {
+        SlabPage* next = page->next_young;
+        page->young = false;
+        freed += page_free_unmarked(vm, page, true);
+        page = next;
+    }
+    vm->young_pages = NULL;
+    return freed;
+}
+
+// Frees the unmarked objects in a page taken off cls->unswept. Returns
+// the number of slots looked at.
+static size_t sweep_page(VM* vm, SizeClass* cls, SlabPage* page) {
+    page->available = false; // See finish_marking.
+    uint32_t slot_count = page->slot_count;
+    vm->gc_stats.major_freed += page_free_unmarked(vm, page, false);
+    page->sweep_epoch = vm->sweep_epoch;
+    if (page->used == 0) {
+        page_release(vm, page);
+    } else {
+        page->next = cls->pages;
+        cls->pages = page;
+        if (page->free != NULL)
+            make_available(cls, page);
+    }
+    return slot_count;
+}
+
+// Sweeps unswept pages until about `work` slots have been looked at.
+// Returns true once every page has been swept.
+static bool sweep_old(VM* vm, size_t work) {
+    for (; vm->sweep_class < SLAB_CLASSES; vm->sweep_class++) {
+        SizeClass* cls = &vm->size_classes[vm->sweep_class];
+        while (cls->unswept != NULL) {
+            if (work == 0)
+                return false;
+            SlabPage* page = cls->unswept;
+            cls->unswept = page->next;
+            size_t cost = sweep_page(vm, cls, page);
+            work = cost >= work ? 0 : work - cost;
+        }
+    }
+    return true;
+}
+
+// Frees the young objects and the weak references to anything
+// unmarked, once everything that's alive has been marked. Old strings
+// have to be taken out of vm->strings beforehand. Returns the number
+// of bytes freed.
+static size_t finish(VM* vm) {
+    if (vm->root_shape != NULL)
+        shape_remove_white(vm->root_shape, vm);
+    size_t freed = sweep_young(vm);
+    vm->next_minor_gc = vm->bytes_allocated + GC_NURSERY_SIZE;
+    return freed;
+}
+
+static void start_marking(VM* vm) {
+    ASSERT(vm->gc_phase == GC_IDLE, "a collection is already running");
 #ifdef SUBTLE_DEBUG_TRACE_ALLOC
-    size_t before = vm->bytes_allocated;
-    printf("-- gc begin\n");
+    printf("-- gc begin (major)\n");
 #endif
+    // Make every object white again. Every page has been swept, so
+    // they're all on the `pages` lists (or in the region).
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        for (SlabPage* page = vm->size_classes[i].pages; page != NULL; page = page->next)
+            memset(page->marks, 0, sizeof(page->marks));
+    for (SlabPage* page = vm->region_pages; page != NULL; page = page->next)
+        memset(page->marks, 0, sizeof(page->marks));
+    forget_remembered(vm);
+    mark_roots(vm);
+    vm->gc_heap_start = vm->bytes_allocated;
+    vm->gc_phase = GC_MARKING;
+    vm->next_gc_step = vm->bytes_allocated + GC_STEP_SIZE;
+}
+
+void memory_start_collect(VM* vm) {
+    double start = now();
+    start_marking(vm);
+    vm->gc_stats.major_steps++;
+    record_pause(&vm->gc_stats.major_time, &vm->gc_stats.major_max_pause, start);
+}
 
+// Ends the marking phase. The old objects are then swept lazily.
+static void finish_marking(VM* vm) {
+    // The roots (and the running fiber) are written to without
+    // barriers, so they have to be looked at again. Everything else
+    // that changed since it was blackened is in vm->remembered.
     mark_roots(vm);
-    trace_references(vm);
+    if (vm->fiber != NULL)
+        memory_barrier(vm, (Obj*)vm->fiber);
+    mark_remembered(vm);
+    forget_remembered(vm);
+    trace_all(vm);
+    trace_ephemerons(vm, true);
+    clear_weak(vm);
     table_remove_white(&vm->strings, vm);
-    sweep(vm);
+    vm->gc_stats.major_freed += finish(vm);
+    // Every page now has to be swept before its free slots can be
+    // used again, since new objects would look unmarked.
+    vm->sweep_epoch++;
+    vm->sweep_class = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        SizeClass* cls = &vm->size_classes[i];
+        cls->unswept = cls->pages;
+        cls->pages = NULL;
+        cls->available = NULL;
+    }
+    vm->gc_phase = GC_SWEEPING;
+    vm->gc_stats.major_count++;
+}
+
+// Keeps the start of the next full collection within the policy's
+// limits. Past max_heap, collections are still spaced out by a
+// nursery's worth of allocation.
+static size_t limit_next_gc(VM* vm, size_t next_gc) {
+    GCPolicy* policy = &vm->gc_policy;
+    if (next_gc < policy->min_heap)
+        next_gc = policy->min_heap;
+    if (policy->max_heap != 0 && next_gc > policy->max_heap)
+        next_gc = policy->max_heap;
+    if (next_gc < vm->bytes_allocated + GC_NURSERY_SIZE)
+        next_gc = vm->bytes_allocated + GC_NURSERY_SIZE;
+    return next_gc;
+}
+
+// Measures the cycle that just ended, then decides when the next one
+// starts (and how long its steps are), see GCPolicy.
+static void update_policy(VM* vm) {
+    GCPolicy* policy = &vm->gc_policy;
+    GCStats* stats = &vm->gc_stats;
+    GCStats* last = &vm->gc_cycle_stats;
+    double end = now();
+    // `cost` is the full collection itself, minor collections are
+    // paid for in proportion to allocation anyway.
+    double cost = (stats->major_time - last->major_time)
+                + (stats->sweep_time - last->sweep_time);
+    double gc_time = cost + (stats->minor_time - last->minor_time);
+    double elapsed = end - vm->gc_cycle_start;
+    double running = elapsed - gc_time;
+    bool measured = vm->gc_cycle_start != 0 && running > 0;
+    size_t live = vm->bytes_allocated;
 
-    vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (measured) {
+        stats->alloc_rate = (stats->bytes_allocated_total
+                             - last->bytes_allocated_total) / running;
+        stats->overhead = gc_time / elapsed;
+    }
+    if (vm->gc_heap_start != 0)
+        stats->survival_rate = (double)live / vm->gc_heap_start;
+
+    size_t next_gc;
+    if (policy->target_overhead > 0 && measured && stats->alloc_rate > 0) {
+        // A cycle costs about the same with a heap growing by
+        // `headroom` bytes, and happens every headroom / alloc_rate
+        // seconds. The cost grows with the live heap, so the headroom
+        // does too: the more of the heap survives, the more it grows.
+        double headroom = cost * stats->alloc_rate / policy->target_overhead;
+        double most = live * GC_MAX_GROW_FACTOR;
+        next_gc = live + (size_t)(headroom < most ? headroom : most);
+    } else {
+        next_gc = (size_t)(live * policy->grow_factor);
+    }
+    vm->next_gc = limit_next_gc(vm, next_gc);
+
+    size_t steps = (stats->major_steps - last->major_steps)
+                 + (stats->sweep_steps - last->sweep_steps);
+    if (policy->target_pause > 0 && steps > 2) {
+        double work = vm->gc_step_work * policy->target_pause / (cost / steps);
+        if (work < GC_STEP_WORK / 64) work = GC_STEP_WORK / 64;
+        if (work > GC_STEP_WORK * 64) work = GC_STEP_WORK * 64;
+        vm->gc_step_work = (size_t)work;
+    }
+
+    vm->gc_cycle_start = end;
+    vm->gc_cycle_stats = *stats;
+}
+
+void memory_set_policy(VM* vm, GCPolicy policy) {
+    vm->gc_policy = policy;
+    if (vm->gc_phase == GC_IDLE)
+        vm->next_gc = limit_next_gc(vm, vm->next_gc);
+}
+
+static void finish_sweeping(VM* vm) {
+    vm->gc_phase = GC_IDLE;
+    update_policy(vm);
 
 #ifdef SUBTLE_MALLOC_TRIM
     malloc_trim(0);
 #endif
 
 #ifdef SUBTLE_DEBUG_TRACE_ALLOC
-    printf("-- gc end collected=%zu from=%zu to=%zu next=%zu\n",
-           before - vm->bytes_allocated,
-           before,
+    printf("-- gc end bytes=%zu next=%zu\n",
            vm->bytes_allocated,
            vm->next_gc);
 #endif
 }
+
+void memory_step(VM* vm) {
+    ASSERT(vm->gc_phase != GC_IDLE, "no collection is running");
+    GCStats* stats = &vm->gc_stats;
+    double start = now();
+    if (vm->gc_phase == GC_MARKING) {
+        if (trace_references(vm, vm->gc_step_work))
+            finish_marking(vm);
+        stats->major_steps++;
+        record_pause(&stats->major_time, &stats->major_max_pause, start);
+    } else {
+        if (sweep_old(vm, vm->gc_step_work))
+            finish_sweeping(vm);
+        stats->sweep_steps++;
+        record_pause(&stats->sweep_time, &stats->sweep_max_pause, start);
+    }
+    vm->next_gc_step = vm->bytes_allocated + GC_STEP_SIZE;
+}
+
+void memory_collect(VM* vm) {
+    GCStats* stats = &vm->gc_stats;
+    double start = now();
+    // A new collection can't start before the last one is swept.
+    if (vm->gc_phase == GC_SWEEPING) {
+        sweep_old(vm, SIZE_MAX);
+        finish_sweeping(vm);
+    }
+    if (vm->gc_phase == GC_IDLE)
+        start_marking(vm);
+    trace_all(vm);
+    finish_marking(vm);
+    stats->major_steps++;
+    record_pause(&stats->major_time, &stats->major_max_pause, start);
+
+    start = now();
+    sweep_old(vm, SIZE_MAX);
+    finish_sweeping(vm);
+    stats->sweep_steps++;
+    record_pause(&stats->sweep_time, &stats->sweep_max_pause, start);
+}
+
+void memory_collect_young(VM* vm) {
+#ifdef SUBTLE_NO_GENERATIONAL_GC
+    memory_collect(vm);
+#else
+    ASSERT(vm->gc_phase != GC_MARKING, "a collection is already marking");
+#ifdef SUBTLE_DEBUG_TRACE_ALLOC
+    printf("-- gc begin (minor)\n");
+#endif
+    double start = now();
+    mark_roots(vm);
+    // The running fiber is written to without barriers.
+    if (vm->fiber != NULL)
+        memory_barrier(vm, (Obj*)vm->fiber);
+    mark_remembered(vm);
+    forget_remembered(vm);
+    trace_references(vm, SIZE_MAX);
+    trace_ephemerons(vm, false);
+    clear_weak(vm);
+    vm->gc_stats.minor_freed += finish(vm);
+#ifdef SUBTLE_DEBUG_TRACE_ALLOC
+    printf("-- gc end (minor) bytes=%zu\n", vm->bytes_allocated);
+#endif
+    vm->gc_stats.minor_count++;
+    record_pause(&vm->gc_stats.minor_time, &vm->gc_stats.minor_max_pause, start);
+#endif
+}
+
+void memory_begin_region(VM* vm) {
+    if (vm->region_depth++ == 0)
+        vm->region_major_count = vm->gc_stats.major_count;
+}
+
+// Frees the dead objects of a region page. A page with survivors is
+// pinned: it goes on its size class' lists, with the slots past the
+// bump pointer free.
+static void release_region_page(VM* vm, SlabPage* page) {
+    GCStats* stats = &vm->gc_stats;
+    bool pinned = false;
+    for (int w = 0; w < SLAB_BITMAP_WORDS && !pinned; w++)
+        pinned = page->marks[w] != 0;
+    if (pinned) {
+        for (uint32_t i = page->slot_count; i-- > page->used;) {
+            void** slot = (void**)page_slot(page, i);
+            *slot = page->free;
+            page->free = slot;
+        }
+    }
+    page_free_unmarked(vm, page, true);
+    if (!pinned) {
+        page_release(vm, page);
+        stats->region_pages_freed++;
+        return;
+    }
+    SizeClass* cls = &vm->size_classes[page->size_class];
+    page->region = false;
+    page->sweep_epoch = vm->sweep_epoch;
+    page->next = cls->pages;
+    cls->pages = page;
+    if (page->free != NULL)
+        make_available(cls, page);
+    stats->region_pages_pinned++;
+}
+
+void memory_end_region(VM* vm) {
+    ASSERT(vm->region_depth > 0, "no region to end");
+    if (--vm->region_depth > 0)
+        return;
+    // Mark whatever escaped. Like young objects, the objects of the
+    // region are only marked if they're reachable from the roots or
+    // from old objects. But a full collection that ran during the
+    // region has marked the ones alive back then for good, so it
+    // takes a fresh one to tell which are still alive. One that is
+    // still marking has to finish first.
+    if (vm->gc_phase == GC_MARKING)
+        memory_collect(vm);
+    if (vm->gc_stats.major_count != vm->region_major_count)
+        memory_collect(vm);
+    else
+        memory_collect_young(vm);
+    SlabPage* page = vm->region_pages;
+    while (page != NULL) {
+        SlabPage* next = page->next;
+        release_region_page(vm, page);
+        page = next;
+    }
+    vm->region_pages = NULL;
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        vm->size_classes[i].region = NULL;
+    vm->gc_stats.region_count++;
+}
+
+#ifdef SUBTLE_DEBUG_PRINT_GC_STATS
+void memory_print_stats(VM* vm) {
+    GCStats* stats = &vm->gc_stats;
+    fprintf(stderr, "gc: %zu minor (%.3fms total, %.3fms max), "
+                    "%zu major in %zu steps (%.3fms total, %.3fms max), "
+                    "swept in %zu steps (%.3fms total, %.3fms max)\n",
+            stats->minor_count, stats->minor_time * 1e3, stats->minor_max_pause * 1e3,
+            stats->major_count, stats->major_steps,
+            stats->major_time * 1e3, stats->major_max_pause * 1e3,
+            stats->sweep_steps, stats->sweep_time * 1e3, stats->sweep_max_pause * 1e3);
+}
+#endif
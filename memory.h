@@ -12,6 +12,7 @@
 
 #define ALLOCATE(vm, type) (type*)memory_realloc(vm, NULL, 0, sizeof(type))
 #define FREE(vm, type, pointer) memory_realloc(vm, pointer, sizeof(type), 0)
+#define FREE_OBJECT(vm, type, pointer) memory_free_object(vm, pointer, sizeof(type))
 
 #define ALLOCATE_ARRAY(vm, type, size) (type*)memory_realloc(vm, NULL, 0, sizeof(type) * (size))
 #define GROW_ARRAY(vm, ptr, type, old_size, new_size) \
@@ -21,9 +22,118 @@
 #define FREE_ARRAY(vm, ptr, type, size) \
     memory_realloc(vm, ptr, sizeof(type) * (size), 0)
 
+// Bytes allocated between minor collections.
+#define GC_NURSERY_SIZE (512 * 1024)
+// Bytes allocated between two steps of an incremental collection.
+#define GC_STEP_SIZE (64 * 1024)
+// Default for vm->gc_step_work.
+#define GC_STEP_WORK 16384
+// Defaults for vm->gc_policy.
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_GROW_FACTOR 2.0
+#define GC_TARGET_OVERHEAD 0.05
+
 void* memory_realloc(VM* vm, void* ptr, size_t old_size, size_t new_size);
+void* memory_calloc(VM* vm, size_t size);
+// Objects come from the slab allocator instead, see object_allocate.
+void* memory_allocate_object(VM* vm, ObjType type, size_t size);
+void memory_free_object(VM* vm, void* ptr, size_t size);
+// Frees every object, for vm_free.
+void memory_free_objects(VM* vm);
 void mark_object(VM*, Obj*);
 void mark_value(VM*, Value);
+// Full collection. This finishes the incremental one if there is
+// one running.
 void memory_collect(VM* vm);
+// Starts an incremental full collection: marking is then done in
+// steps of about vm->gc_step_work values, every GC_STEP_SIZE bytes.
+// Sweeping is done the same way afterwards.
+void memory_start_collect(VM* vm);
+void memory_step(VM* vm);
+// Minor collection: only young objects are freed (or promoted).
+void memory_collect_young(VM* vm);
+void memory_remember(VM* vm, Obj* obj);
+// Regions, for objects that mostly die together (e.g. the ones made
+// while handling a request). Until the matching memory_end_region,
+// objects are bumped out of pages of their own and minor collections
+// are put off. Ending the region then runs a minor collection, which
+// finds the objects that escaped (into globals, handles or older
+// objects): objects are never moved, so their pages are pinned, that
+// is, become ordinary pages. The other pages are freed whole. Regions
+// can be nested, only the outermost one counts.
+void memory_begin_region(VM* vm);
+void memory_end_region(VM* vm);
+// Changes vm->gc_policy. The limits apply to the next full collection
+// right away.
+void memory_set_policy(VM* vm, GCPolicy policy);
+#ifdef SUBTLE_DEBUG_PRINT_GC_STATS
+void memory_print_stats(VM* vm);
+#endif
+
+// A page of the object allocator, see memory.c. It's here so that
+// is_marked can be inlined.
+struct SlabPage {
+    struct SlabPage* next;           // In SizeClass->pages or ->unswept.
+    struct SlabPage* next_available; // In SizeClass->available.
+    struct SlabPage* next_young;     // In vm->young_pages.
+    void* free;                      // Free slots, linked through their first word.
+    uint32_t slot_size;
+    uint32_t slot_count;
+    uint32_t used;
+    uint32_t sweep_epoch; // The vm->sweep_epoch this page was last swept in.
+    uint8_t size_class;
+    bool available;       // Is this (swept) page in SizeClass->available?
+    bool young;           // Is this page in vm->young_pages?
+    bool region;          // Is this page in vm->region_pages?
+    // Bitmaps with a bit for each SLAB_GRANULE of the page, set for the
+    // first granule of each object (`allocated`) and of each marked
+    // object (`marks`). Keeping the mark bits out of the objects means
+    // that a collection doesn't write to every live object.
+    uint64_t allocated[SLAB_PAGE_SIZE / SLAB_GRANULE / 64];
+    uint64_t marks[SLAB_PAGE_SIZE / SLAB_GRANULE / 64];
+};
+
+static inline SlabPage* page_of(const void* ptr) {
+    return (SlabPage*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static inline uint32_t page_granule(const SlabPage* page, const void* ptr) {
+    return (uint32_t)(((uintptr_t)ptr - (uintptr_t)page) / SLAB_GRANULE);
+}
+
+// Does this object have a live reference?
+static inline bool
+is_marked(VM* vm, Obj* obj)
+{
+    SlabPage* page = page_of(obj);
+    uint32_t i = page_granule(page, obj);
+    return (page->marks[i / 64] >> (i % 64)) & 1;
+}
+
+// Write barrier: call this after storing a reference to another
+// object in `obj` (and before allocating anything else). Between
+// collections only old objects are marked, so minor collections can
+// find references from old objects to young ones. While an
+// incremental collection is marking, this finds references stored
+// in objects that were already blackened. Stores into the running
+// fiber don't need it.
+static inline void
+memory_barrier(VM* vm, Obj* obj)
+{
+    if (is_marked(vm, obj) && !obj->remembered)
+        memory_remember(vm, obj);
+}
+
+// For stores that can't be pinned on an object, such as through an
+// open upvalue into a fiber that isn't running: keeps `value` alive
+// until the current (or next) collection is done.
+static inline void
+memory_barrier_value(VM* vm, Value value)
+{
+    if (!IS_OBJ(value)) return;
+    Obj* obj = VAL_TO_OBJ(value);
+    if (!is_marked(vm, obj) && !obj->remembered)
+        memory_remember(vm, obj);
+}
 
 #endif
@@ -6,6 +6,7 @@
 #include "value.h"
 #include "vm.h"
 
+#include <math.h> // trunc
 #include <stdint.h>
 #include <stdlib.h> // free
 #include <string.h> // memcpy
@@ -19,12 +20,9 @@
 Obj*
 object_allocate(VM* vm, ObjType type, size_t sz)
 {
-    Obj* object = memory_realloc(vm, NULL, 0, sz);
+    Obj* object = memory_allocate_object(vm, type, sz);
     object->type = type;
-    object->next = vm->objects;
-    object->visited = false;
-    object->marked = false;
-    vm->objects = object;
+    object->remembered = false;
 #ifdef SUBTLE_DEBUG_TRACE_ALLOC
     printf("%p allocate %zu for type %d\n", object, sz, type);
 #endif
@@ -43,6 +41,9 @@ static void objlist_free(VM*, Obj*);
 static void objmap_free(VM*, Obj*);
 static void objmsg_free(VM*, Obj*);
 static void objforeign_free(VM*, Obj*);
+static void objweakref_free(VM*, Obj*);
+static void objweakmap_free(VM*, Obj*);
+static void shape_free(VM*, Obj*);
 
 void
 object_free(Obj* obj, VM* vm)
@@ -63,9 +64,35 @@ object_free(Obj* obj, VM* vm)
     case OBJ_MAP: objmap_free(vm, obj); break;
     case OBJ_MSG: objmsg_free(vm, obj); break;
     case OBJ_FOREIGN: objforeign_free(vm, obj); break;
+    case OBJ_WEAKREF: objweakref_free(vm, obj); break;
+    case OBJ_WEAKMAP: objweakmap_free(vm, obj); break;
+    case OBJ_SHAPE: shape_free(vm, obj); break;
     }
 }
 
+const char*
+object_type_name(ObjType type)
+{
+    switch (type) {
+    case OBJ_STRING:  return "String";
+    case OBJ_FN:      return "fn";
+    case OBJ_UPVALUE: return "upvalue";
+    case OBJ_CLOSURE: return "Fn";
+    case OBJ_OBJECT:  return "Object";
+    case OBJ_NATIVE:  return "Native";
+    case OBJ_FIBER:   return "Fiber";
+    case OBJ_RANGE:   return "Range";
+    case OBJ_LIST:    return "List";
+    case OBJ_MAP:     return "Map";
+    case OBJ_MSG:     return "Msg";
+    case OBJ_FOREIGN: return "Foreign";
+    case OBJ_WEAKREF: return "WeakRef";
+    case OBJ_WEAKMAP: return "WeakMap";
+    case OBJ_SHAPE:   return "shape";
+    }
+    return "?";
+}
+
 // ObjString
 // =========
 
@@ -100,7 +127,7 @@ objstring_free(VM* vm, Obj* obj)
 {
     ObjString* str = (ObjString*)obj;
     FREE_ARRAY(vm, str->chars, char, str->length + 1);
-    FREE(vm, ObjString, str);
+    FREE_OBJECT(vm, ObjString, str);
 }
 
 ObjString*
@@ -174,7 +201,7 @@ objfn_free(VM* vm, Obj* obj)
 {
     ObjFn* fn = (ObjFn*)obj;
     chunk_free(&fn->chunk, vm);
-    FREE(vm, ObjFn, fn);
+    FREE_OBJECT(vm, ObjFn, fn);
 }
 
 // ObjUpvalue
@@ -194,7 +221,7 @@ static void
 objupvalue_free(VM* vm, Obj* obj)
 {
     ObjUpvalue* upvalue = (ObjUpvalue*)obj;
-    FREE(vm, ObjUpvalue, upvalue);
+    FREE_OBJECT(vm, ObjUpvalue, upvalue);
 }
 
 // ObjClosure
@@ -219,7 +246,88 @@ objclosure_free(VM* vm, Obj* obj)
 {
     ObjClosure* closure = (ObjClosure*)obj;
     FREE_ARRAY(vm, closure->upvalues, ObjUpvalue*, closure->upvalue_count);
-    FREE(vm, ObjClosure, closure);
+    FREE_OBJECT(vm, ObjClosure, closure);
+}
+
+// Shape
+// =====
+
+Shape*
+shape_new(VM* vm, Shape* parent, Value key)
+{
+    Shape* shape = ALLOCATE_OBJECT(vm, OBJ_SHAPE, Shape);
+    shape->parent = parent;
+    shape->keys = NULL;
+    shape->count = 0;
+    table_init(&shape->transitions);
+    if (parent == NULL)
+        return shape;
+
+    vm_push_root(vm, OBJ_TO_VAL(shape));
+    Value* keys = ALLOCATE_ARRAY(vm, Value, parent->count + 1);
+    for (uint32_t i = 0; i < parent->count; i++)
+        keys[i] = parent->keys[i];
+    keys[parent->count] = key;
+    shape->keys = keys;
+    shape->count = parent->count + 1;
+    memory_barrier(vm, (Obj*)shape);
+    vm_pop_root(vm);
+    return shape;
+}
+
+int
+shape_find(Shape* shape, Value key)
+{
+    for (uint32_t i = 0; i < shape->count; i++)
+        if (value_equal(shape->keys[i], key))
+            return (int)i;
+    return -1;
+}
+
+Shape*
+shape_add(Shape* shape, VM* vm, Value key)
+{
+    Value* child = table_find(&shape->transitions, key);
+    if (child != NULL)
+        return (Shape*)VAL_TO_OBJ(*child);
+    // Objects with lots of slots, or used as maps, are better off
+    // with their own table.
+    if (shape->count >= SHAPE_MAX_SLOTS
+            || shape->transitions.count >= SHAPE_MAX_TRANSITIONS)
+        return NULL;
+
+    Shape* new_shape = shape_new(vm, shape, key);
+    vm_push_root(vm, OBJ_TO_VAL(new_shape));
+    table_set(&shape->transitions, vm, key, OBJ_TO_VAL(new_shape));
+    vm_pop_root(vm);
+    return new_shape;
+}
+
+void
+shape_remove_white(Shape* shape, VM* vm)
+{
+    Table* table = &shape->transitions;
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
+        Shape* child = (Shape*)VAL_TO_OBJ(entry->value);
+        if (is_marked(vm, &child->obj)) {
+            shape_remove_white(child, vm);
+        } else {
+            table_remove_entry(table, entry);
+        }
+    }
+}
+
+static void
+shape_free(VM* vm, Obj* obj)
+{
+    Shape* shape = (Shape*)obj;
+    // Caches may still refer to this shape by address.
+    vm->ic_epoch++;
+    FREE_ARRAY(vm, shape->keys, Value, shape->count);
+    table_free(&shape->transitions, vm);
+    FREE_OBJECT(vm, Shape, shape);
 }
 
 // ObjObject
@@ -230,11 +338,35 @@ objobject_new(VM* vm)
 {
     ObjObject* object = ALLOCATE_OBJECT(vm, OBJ_OBJECT, ObjObject);
     table_init(&object->slots);
-    object->protos = NULL;
+    object->protos = &object->inline_proto;
     object->protos_count = 0;
+    object->shape = vm->root_shape;
+    object->values = object->inline_values;
+    object->values_capacity = OBJECT_INLINE_SLOTS;
+    object->ancestors = NULL;
+    object->ancestors_count = 0;
+    object->ancestors_capacity = 0;
+    object->ancestors_epoch = 0;
+    object->watched = false;
     return object;
 }
 
+// Called whenever the layout of obj's slots or protos changes.
+static inline void
+objobject_changed(ObjObject* obj, VM* vm)
+{
+    if (obj->watched)
+        vm->ic_epoch++;
+}
+
+// Called whenever obj's protos change.
+static inline void
+objobject_protos_changed(ObjObject* obj, VM* vm)
+{
+    vm->proto_epoch++;
+    objobject_changed(obj, vm);
+}
+
 void
 objobject_set_proto(ObjObject* obj, VM* vm, Value proto)
 {
@@ -243,44 +375,68 @@ objobject_set_proto(ObjObject* obj, VM* vm, Value proto)
         return;
     }
     obj->protos[0] = proto;
+    memory_barrier(vm, (Obj*)obj);
+    objobject_protos_changed(obj, vm);
+}
+
+// Makes room for `length` protos, keeping the first ones.
+static void
+objobject_resize_protos(ObjObject* obj, VM* vm, uint32_t length)
+{
+    Value* protos = obj->protos;
+    uint32_t count = obj->protos_count;
+    if (protos == &obj->inline_proto) {
+        if (length <= 1) return;
+        obj->protos = ALLOCATE_ARRAY(vm, Value, length);
+        if (count == 1)
+            obj->protos[0] = obj->inline_proto;
+    } else if (length <= 1) {
+        if (length == 1)
+            obj->inline_proto = protos[0];
+        obj->protos = &obj->inline_proto;
+        FREE_ARRAY(vm, protos, Value, count);
+    } else {
+        obj->protos = GROW_ARRAY(vm, protos, Value, count, length);
+    }
 }
 
 void
 objobject_insert_proto(ObjObject* obj, VM* vm, uint32_t idx, Value proto)
 {
     ASSERT(obj->protos_count >= idx, "obj->protos_count < idx");
-    obj->protos = GROW_ARRAY(vm, obj->protos, Value, obj->protos_count, obj->protos_count + 1);
+    objobject_resize_protos(obj, vm, obj->protos_count + 1);
     obj->protos_count++;
     for (uint32_t i = obj->protos_count - 1; i > idx; i--)
         obj->protos[i] = obj->protos[i - 1];
     obj->protos[idx] = proto;
+    memory_barrier(vm, (Obj*)obj);
+    objobject_protos_changed(obj, vm);
 }
 
 void
 objobject_delete_proto(ObjObject* obj, VM* vm, Value proto)
 {
-    uint32_t old_size = obj->protos_count;
-    for (int i = 0; i < obj->protos_count;) {
-        if (value_equal(obj->protos[i], proto)) {
-            obj->protos_count--;
-            for (int j = i; j < obj->protos_count; j++)
-                obj->protos[j] = obj->protos[j + 1];
-        } else {
-            i++;
-        }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < obj->protos_count; i++)
+        if (!value_equal(obj->protos[i], proto))
+            obj->protos[count++] = obj->protos[i];
+    if (count != obj->protos_count) {
+        objobject_resize_protos(obj, vm, count);
+        obj->protos_count = count;
+        objobject_protos_changed(obj, vm);
     }
-    if (obj->protos_count != old_size)
-        obj->protos = GROW_ARRAY(vm, obj->protos, Value, old_size, obj->protos_count);
 }
 
 void
 objobject_copy_protos(ObjObject* obj, VM* vm, Value* protos, uint32_t length)
 {
     if (length != obj->protos_count)
-        obj->protos = GROW_ARRAY(vm, obj->protos, Value, obj->protos_count, length);
+        objobject_resize_protos(obj, vm, length);
     obj->protos_count = length;
     for (uint32_t i = 0; i < length; i++)
         obj->protos[i] = protos[i];
+    memory_barrier(vm, (Obj*)obj);
+    objobject_protos_changed(obj, vm);
 }
 
 bool
@@ -293,28 +449,123 @@ objobject_has(ObjObject* obj, Value key)
 bool
 objobject_get(ObjObject* obj, Value key, Value* result)
 {
-    return table_get(&obj->slots, key, result);
+    Value* slot = objobject_find(obj, key);
+    if (slot == NULL)
+        return false;
+    *result = *slot;
+    return true;
+}
+
+Value*
+objobject_find(ObjObject* obj, Value key)
+{
+    if (obj->shape != NULL) {
+        int index = shape_find(obj->shape, key);
+        return index < 0 ? NULL : &obj->values[index];
+    }
+    return table_find(&obj->slots, key);
+}
+
+static void
+objobject_free_values(ObjObject* obj, VM* vm)
+{
+    if (obj->values != obj->inline_values)
+        FREE_ARRAY(vm, obj->values, Value, obj->values_capacity);
+}
+
+// Move the slots of obj from its shape into obj->slots.
+static void
+objobject_to_dictionary(ObjObject* obj, VM* vm)
+{
+    // The shape stays in place (so the GC keeps marking the values)
+    // until every slot has been copied.
+    Shape* shape = obj->shape;
+    for (uint32_t i = 0; i < shape->count; i++)
+        table_set(&obj->slots, vm, shape->keys[i], obj->values[i]);
+    objobject_free_values(obj, vm);
+    obj->values = NULL;
+    obj->values_capacity = 0;
+    obj->shape = NULL;
 }
 
 void
 objobject_set(ObjObject* obj, VM* vm, Value key, Value value)
 {
-    table_set(&obj->slots, vm, key, value);
+    if (obj->shape != NULL) {
+        int index = shape_find(obj->shape, key);
+        if (index >= 0) {
+            obj->values[index] = value;
+            memory_barrier(vm, (Obj*)obj);
+            return;
+        }
+        Shape* shape = shape_add(obj->shape, vm, key);
+        if (shape != NULL) {
+            if (shape->count > obj->values_capacity) {
+                // Until obj uses it, only the (weak) transition
+                // refers to the new shape.
+                vm_push_root(vm, OBJ_TO_VAL(shape));
+                uint32_t capacity = obj->values_capacity * 2;
+                if (obj->values == obj->inline_values) {
+                    Value* values = ALLOCATE_ARRAY(vm, Value, capacity);
+                    memcpy(values, obj->inline_values, sizeof(obj->inline_values));
+                    obj->values = values;
+                } else {
+                    obj->values = GROW_ARRAY(vm, obj->values, Value, obj->values_capacity, capacity);
+                }
+                obj->values_capacity = capacity;
+                vm_pop_root(vm);
+            }
+            obj->values[shape->count - 1] = value;
+            obj->shape = shape;
+            memory_barrier(vm, (Obj*)obj);
+            objobject_changed(obj, vm);
+            return;
+        }
+        objobject_to_dictionary(obj, vm);
+        objobject_changed(obj, vm);
+    }
+    // Overwriting an existing slot keeps its location (which is what
+    // the inline caches remember), unless the table had to grow.
+    Entry* entries = obj->slots.entries;
+    bool changed = table_set(&obj->slots, vm, key, value) || obj->slots.entries != entries;
+    memory_barrier(vm, (Obj*)obj);
+    if (changed)
+        objobject_changed(obj, vm);
 }
 
 bool
 objobject_delete(ObjObject* obj, VM* vm, Value key)
 {
-    return table_delete(&obj->slots, vm, key);
+    if (obj->shape != NULL) {
+        int index = shape_find(obj->shape, key);
+        if (index < 0)
+            return false;
+        // Deleting the last slot added just goes back to the parent.
+        if ((uint32_t)index == obj->shape->count - 1) {
+            obj->shape = obj->shape->parent;
+            objobject_changed(obj, vm);
+            return true;
+        }
+        objobject_to_dictionary(obj, vm);
+    }
+    if (!table_delete(&obj->slots, vm, key))
+        return false;
+    objobject_changed(obj, vm);
+    return true;
 }
 
 static void
 objobject_free(VM* vm, Obj* obj)
 {
     ObjObject* object = (ObjObject*)obj;
+    // Caches may still refer to this object by address.
+    objobject_changed(object, vm);
+    objobject_free_values(object, vm);
     table_free(&object->slots, vm);
-    FREE_ARRAY(vm, object->protos, Value, object->protos_count);
-    FREE(vm, ObjObject, object);
+    free(object->ancestors);
+    if (object->protos != &object->inline_proto)
+        FREE_ARRAY(vm, object->protos, Value, object->protos_count);
+    FREE_OBJECT(vm, ObjObject, object);
 }
 
 // ObjNative
@@ -338,7 +589,7 @@ objnative_new_with_context(VM* vm, NativeFn fn, void* ctx)
 static void
 objnative_free(VM* vm, Obj* obj)
 {
-    FREE(vm, ObjNative, obj);
+    FREE_OBJECT(vm, ObjNative, obj);
 }
 
 // ObjFiber
@@ -436,6 +687,7 @@ objfiber_push_frame(ObjFiber* fiber, VM* vm,
     }
     CallFrame* frame = &fiber->frames[fiber->frames_count++];
     frame->closure = closure;
+    memory_barrier(vm, (Obj*)fiber);
     frame->ip = closure->fn->chunk.code;
     frame->slots = stack_start;
     return frame;
@@ -453,7 +705,7 @@ objfiber_free(VM* vm, Obj* obj)
     ObjFiber* fiber = (ObjFiber*)obj;
     FREE_ARRAY(vm, fiber->stack, Value, fiber->stack_capacity);
     FREE_ARRAY(vm, fiber->frames, CallFrame, fiber->frames_capacity);
-    FREE(vm, ObjFiber, obj);
+    FREE_OBJECT(vm, ObjFiber, obj);
 }
 
 // ObjRange
@@ -469,10 +721,57 @@ objrange_new(VM* vm, double start, double end, bool inclusive)
     return range;
 }
 
+Value
+range_iter_more(double start, double end, bool inclusive, Value iter)
+{
+    // nothing to iterate?
+    if (start == end && !inclusive)
+        return FALSE_VAL;
+
+    double v;
+    if (IS_NIL(iter)) {
+        // start of the iteration.
+        v = start;
+    } else if (IS_NUMBER(iter)) {
+        v = VAL_TO_NUMBER(iter);
+        if (start <= end) {
+            // 0..5 or 0...5
+            v = v + 1;
+            if (v < start) return FALSE_VAL;
+            if (inclusive && v > end) return FALSE_VAL;
+            if (!inclusive && v >= end) return FALSE_VAL;
+        } else {
+            // 5..0 or 5...0
+            v = v - 1;
+            if (v > start) return FALSE_VAL;
+            if (inclusive && v < end) return FALSE_VAL;
+            if (!inclusive && v <= end) return FALSE_VAL;
+        }
+    } else {
+        return FALSE_VAL;
+    }
+    return NUMBER_TO_VAL(v);
+}
+
+Value
+sequence_iter_more(Value iter, uint32_t length)
+{
+    double idx;
+    if (IS_NIL(iter))
+        idx = 0;
+    else if (IS_NUMBER(iter))
+        idx = VAL_TO_NUMBER(iter) + 1;
+    else
+        return FALSE_VAL;
+    if (trunc(idx) != idx || idx < 0 || idx >= length)
+        return FALSE_VAL;
+    return NUMBER_TO_VAL(idx);
+}
+
 static void
 objrange_free(VM* vm, Obj* obj)
 {
-    FREE(vm, ObjRange, obj);
+    FREE_OBJECT(vm, ObjRange, obj);
 }
 
 // ObjList
@@ -491,6 +790,7 @@ objlist_new(VM* vm, uint32_t size)
     list->values = values;
     list->size = size;
     list->capacity = size;
+    list->dirty = UINT32_MAX;
     return list;
 }
 
@@ -501,11 +801,22 @@ objlist_get(ObjList* list, uint32_t idx)
     return list->values[idx];
 }
 
+// Barrier for stores to list->values[idx..].
+static inline void
+list_barrier(ObjList* list, VM* vm, uint32_t idx)
+{
+    if (!is_marked(vm, &list->obj)) return;
+    if (idx < list->dirty)
+        list->dirty = idx;
+    memory_barrier(vm, (Obj*)list);
+}
+
 void
-objlist_set(ObjList* list, uint32_t idx, Value v)
+objlist_set(ObjList* list, VM* vm, uint32_t idx, Value v)
 {
     ASSERT(list->size > idx, "list->size <= idx");
     list->values[idx] = v;
+    list_barrier(list, vm, idx);
 }
 
 void
@@ -517,6 +828,8 @@ objlist_del(ObjList* list, VM* vm, uint32_t idx)
     list->size--;
     for (uint32_t i = idx; i < list->size; i++)
         list->values[i] = list->values[i + 1];
+    if (list->obj.remembered && idx < list->dirty)
+        list->dirty = idx;
     // Compact the list if necessary.
     if (list->capacity > 8
         && list->size * 2 < list->capacity) {
@@ -539,6 +852,7 @@ objlist_insert(ObjList* list, VM* vm, uint32_t idx, Value v)
     for (uint32_t i = list->size - 1; i > idx; i--)
         list->values[i] = list->values[i - 1];
     list->values[idx] = v;
+    list_barrier(list, vm, idx);
 }
 
 void
@@ -546,51 +860,468 @@ objlist_free(VM* vm, Obj* obj)
 {
     ObjList* list = (ObjList*)obj;
     FREE_ARRAY(vm, list->values, Value, list->capacity);
-    FREE(vm, ObjList, list);
+    FREE_OBJECT(vm, ObjList, list);
 }
 
 // ObjMap
 // ======
 
+// The index has `capacity` slots, each holding the position of an
+// entry plus one, MAP_EMPTY or MAP_DELETED. Colliding keys are probed
+// linearly.
+#define MAP_EMPTY   0
+#define MAP_DELETED UINT32_MAX
+
+static inline uint32_t*
+map_index(Entry* entries, uint32_t capacity)
+{
+    return (uint32_t*)(entries + MAP_USABLE(capacity));
+}
+
+static inline size_t
+map_alloc_size(uint32_t capacity)
+{
+    return sizeof(Entry) * MAP_USABLE(capacity) + sizeof(uint32_t) * capacity;
+}
+
 ObjMap*
 objmap_new(VM* vm)
 {
     ObjMap* map = ALLOCATE_OBJECT(vm, OBJ_MAP, ObjMap);
-    table_init(&map->tbl);
+    map->entries = NULL;
+    map->count = 0;
+    map->length = 0;
+    map->capacity = 0;
+    map->array_count = 0;
+    map->array = NULL;
+    map->array_length = 0;
+    map->array_capacity = 0;
+    map->resize = NULL;
     return map;
 }
 
+// Returns the index slot that holds `key`, or the first free one
+// (empty or deleted) that it could go in.
+static uint32_t*
+map_probe(Entry* entries, uint32_t capacity, Value key, bool* found)
+{
+    uint32_t* index = map_index(entries, capacity);
+    uint32_t mask = capacity - 1;
+    uint32_t* tombstone = NULL;
+    for (uint32_t i = value_hash(key) & mask;; i = (i + 1) & mask) {
+        uint32_t slot = index[i];
+        if (slot == MAP_EMPTY) {
+            *found = false;
+            return tombstone != NULL ? tombstone : &index[i];
+        }
+        if (slot == MAP_DELETED) {
+            if (tombstone == NULL)
+                tombstone = &index[i];
+        } else if (value_equal(entries[slot - 1].key, key)) {
+            *found = true;
+            return &index[i];
+        }
+    }
+}
+
+static inline uint32_t*
+map_find(ObjMap* map, Value key, bool* found)
+{
+    return map_probe(map->entries, map->capacity, key, found);
+}
+
+// Looks in the old hash part too, while resizing. The entries that
+// were moved out of it have an UNDEFINED key, so they don't match.
+static Entry*
+map_get_entry(ObjMap* map, Value key)
+{
+    if (map->count == 0) return NULL;
+    bool found;
+    uint32_t* slot = map_find(map, key, &found);
+    if (found)
+        return &map->entries[*slot - 1];
+    MapResize* resize = map->resize;
+    if (resize != NULL) {
+        slot = map_probe(resize->entries, resize->capacity, key, &found);
+        if (found)
+            return &resize->entries[*slot - 1];
+    }
+    return NULL;
+}
+
+// Moves the entries that aren't deleted to a new allocation, in
+// order, and rebuilds the index.
+static void
+map_rebuild(ObjMap* map, VM* vm, uint32_t capacity)
+{
+    Entry* entries = memory_realloc(vm, NULL, 0, map_alloc_size(capacity));
+    ObjMap rebuilt = *map;
+    rebuilt.entries = entries;
+    rebuilt.capacity = capacity;
+    rebuilt.length = 0;
+    uint32_t* index = map_index(entries, capacity);
+    for (uint32_t i = 0; i < capacity; i++)
+        index[i] = MAP_EMPTY;
+    for (uint32_t i = 0; i < map->length; i++) {
+        Entry* entry = &map->entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
+        bool found;
+        *map_find(&rebuilt, entry->key, &found) = rebuilt.length + 1;
+        entries[rebuilt.length++] = *entry;
+    }
+    memory_realloc(vm, map->entries, map_alloc_size(map->capacity), 0);
+    map->entries = entries;
+    map->capacity = capacity;
+    map->length = rebuilt.length;
+}
+
+// The smallest capacity with room for twice `count` entries. Small
+// maps (records, mostly) start out with room for 3.
+static uint32_t
+map_capacity_for(uint32_t count)
+{
+    uint32_t capacity = 4;
+    while (MAP_USABLE(capacity) < count * 2)
+        capacity *= 2;
+    return capacity;
+}
+
+// Incremental Resizing
+// --------------------
+// Rebuilding a large hash part at once would stall whoever happens
+// to add or delete the entry that needs it. Instead, a new hash part
+// is allocated with its first `count` entries kept for the old ones,
+// in order, and each set or delete that goes to the hash part moves a
+// few of them over, as in Redis' dict. Until they have all been moved,
+// lookups go through both. Deleting an old entry gives up the last of
+// the kept ones, which stays deleted. Nothing else in the new part is
+// touched up front: it's allocated zeroed, and the kept entries are
+// only set as they're used.
+#ifdef SUBTLE_NO_INCREMENTAL_RESIZE
+#define MAP_RESIZE_MIN  UINT32_MAX
+#else
+#define MAP_RESIZE_MIN  1024 // Smaller hash parts are rebuilt at once.
+#endif
+#define MAP_RESIZE_STEP 16   // Entries moved per operation.
+
+static void
+map_resize_end(ObjMap* map, VM* vm)
+{
+    MapResize* resize = map->resize;
+    map->resize = NULL;
+    memory_realloc(vm, resize->entries, map_alloc_size(resize->capacity), 0);
+    FREE(vm, MapResize, resize);
+}
+
+// Moves up to MAP_RESIZE_STEP entries over, skipping no more than
+// three times as many deleted ones.
+static void
+map_resize_step(ObjMap* map, VM* vm)
+{
+    MapResize* resize = map->resize;
+    uint32_t end = resize->length - resize->next > MAP_RESIZE_STEP * 4
+        ? resize->next + MAP_RESIZE_STEP * 4
+        : resize->length;
+    uint32_t moved = 0;
+    for (; resize->next < end && moved < MAP_RESIZE_STEP; resize->next++) {
+        Entry* entry = &resize->entries[resize->next];
+        if (IS_UNDEFINED(entry->key)) continue;
+        bool found;
+        *map_find(map, entry->key, &found) = resize->moved + 1;
+        map->entries[resize->moved++] = *entry;
+        ASSERT(resize->moved <= resize->kept, "moved past the kept entries");
+        entry->key = UNDEFINED_VAL;
+        entry->value = NIL_VAL;
+        moved++;
+    }
+    if (resize->next == resize->length)
+        map_resize_end(map, vm);
+}
+
+void
+objmap_finish_resize(ObjMap* map, VM* vm)
+{
+    while (map->resize != NULL)
+        map_resize_step(map, vm);
+}
+
+static void
+map_resize(ObjMap* map, VM* vm, uint32_t capacity)
+{
+    ASSERT(map->resize == NULL, "map is already being resized");
+    if (map->length < MAP_RESIZE_MIN) {
+        map_rebuild(map, vm, capacity);
+        return;
+    }
+    MapResize* resize = ALLOCATE(vm, MapResize);
+    // MAP_EMPTY is 0.
+    Entry* entries = memory_calloc(vm, map_alloc_size(capacity));
+    resize->entries = map->entries;
+    resize->length = map->length;
+    resize->capacity = map->capacity;
+    resize->next = 0;
+    resize->moved = 0;
+    resize->kept = map->count;
+    map->resize = resize;
+    map->entries = entries;
+    map->capacity = capacity;
+    map->length = map->count;
+}
+
+// Adds a key that isn't in the map to the hash part.
+static void
+map_hash_insert(ObjMap* map, VM* vm, Value key, Value val)
+{
+    // Out of room: make some by dropping the deleted entries, or grow.
+    // A resize makes room for more entries than it has to move over,
+    // so it should be done by then.
+    if (map->length == MAP_USABLE(map->capacity)) {
+        objmap_finish_resize(map, vm);
+        if (map->length == MAP_USABLE(map->capacity))
+            map_resize(map, vm, map_capacity_for(map->count + 1));
+    }
+    bool found;
+    *map_find(map, key, &found) = map->length + 1;
+    map->entries[map->length].key = key;
+    map->entries[map->length].value = val;
+    map->length++;
+    map->count++;
+    if (map->resize != NULL)
+        map_resize_step(map, vm);
+}
+
+static bool
+map_hash_delete(ObjMap* map, VM* vm, Value key)
+{
+    if (map->count == 0) return false;
+    bool found;
+    uint32_t* slot = map_find(map, key, &found);
+    Entry* entry;
+    if (found) {
+        entry = &map->entries[*slot - 1];
+    } else if (map->resize != NULL) {
+        MapResize* resize = map->resize;
+        slot = map_probe(resize->entries, resize->capacity, key, &found);
+        if (!found) return false;
+        entry = &resize->entries[*slot - 1];
+        resize->kept--;
+        map->entries[resize->kept].key = UNDEFINED_VAL;
+        map->entries[resize->kept].value = NIL_VAL;
+    } else {
+        return false;
+    }
+    entry->key = UNDEFINED_VAL;
+    entry->value = NIL_VAL;
+    *slot = MAP_DELETED;
+    map->count--;
+    if (map->resize != NULL)
+        map_resize_step(map, vm);
+    // Once most entries are deleted, iterating would mostly skip them.
+    else if (map->length > 8 && map->count * 2 < map->length)
+        map_resize(map, vm, map_capacity_for(map->count));
+    return true;
+}
+
+// The Array Part
+// --------------
+// A non-negative integer key below array_length is in the array part
+// (or nowhere), and key array_length is never in the hash part: so
+// setting it appends it to the array, and then moves the keys after
+// it out of the hash part, for maps filled out of order.
+
+static bool
+map_array_index(Value key, uint32_t* index)
+{
+    if (!IS_NUMBER(key)) return false;
+    double n = VAL_TO_NUMBER(key);
+    if (!(n >= 0 && n < UINT32_MAX) || trunc(n) != n)
+        return false;
+    *index = (uint32_t)n;
+    return true;
+}
+
+static void
+map_array_append(ObjMap* map, VM* vm, Value val)
+{
+    if (map->array_length == map->array_capacity) {
+        uint32_t capacity = GROW_CAPACITY(map->array_capacity);
+        map->array = GROW_ARRAY(vm, map->array, Value, map->array_capacity, capacity);
+        map->array_capacity = capacity;
+    }
+    map->array[map->array_length++] = val;
+    map->array_count++;
+}
+
+// Once most of the array part is missing, the keys after the first
+// missing one go to the hash part.
+static void
+map_array_demote(ObjMap* map, VM* vm)
+{
+    uint32_t end = 0;
+    while (!IS_UNDEFINED(map->array[end]))
+        end++;
+    for (uint32_t i = end + 1; i < map->array_length; i++)
+        if (!IS_UNDEFINED(map->array[i]))
+            map_hash_insert(map, vm, NUMBER_TO_VAL(i), map->array[i]);
+    map->array = GROW_ARRAY(vm, map->array, Value, map->array_capacity, end);
+    map->array_capacity = end;
+    map->array_length = end;
+    map->array_count = end;
+}
+
 bool
 objmap_has(ObjMap* map, Value key)
 {
     Value val;
-    return table_get(&map->tbl, key, &val);
+    return objmap_get(map, key, &val);
 }
 
 bool
 objmap_get(ObjMap* map, Value key, Value* val)
 {
-    return table_get(&map->tbl, key, val);
+    uint32_t index;
+    if (map_array_index(key, &index) && index < map->array_length) {
+        if (IS_UNDEFINED(map->array[index])) return false;
+        *val = map->array[index];
+        return true;
+    }
+    Entry* entry = map_get_entry(map, key);
+    if (entry == NULL) return false;
+    *val = entry->value;
+    return true;
 }
 
 bool
 objmap_set(ObjMap* map, VM* vm, Value key, Value val)
 {
-    return table_set(&map->tbl, vm, key, val);
+    bool is_new_key = true;
+    uint32_t index;
+    if (map_array_index(key, &index) && index <= map->array_length) {
+        if (index < map->array_length) {
+            is_new_key = IS_UNDEFINED(map->array[index]);
+            if (is_new_key)
+                map->array_count++;
+            map->array[index] = val;
+        } else {
+            map_array_append(map, vm, val);
+            Entry* entry;
+            while ((entry = map_get_entry(map, NUMBER_TO_VAL(map->array_length))) != NULL) {
+                map_array_append(map, vm, entry->value);
+                map_hash_delete(map, vm, entry->key);
+            }
+        }
+    } else {
+        Entry* entry = map_get_entry(map, key);
+        if (entry != NULL) {
+            entry->value = val;
+            is_new_key = false;
+        } else {
+            map_hash_insert(map, vm, key, val);
+        }
+    }
+    memory_barrier(vm, (Obj*)map);
+    return is_new_key;
 }
 
 bool
 objmap_delete(ObjMap* map, VM* vm, Value key)
 {
-    return table_delete(&map->tbl, vm, key);
+    uint32_t index;
+    if (!map_array_index(key, &index) || index >= map->array_length)
+        return map_hash_delete(map, vm, key);
+    if (IS_UNDEFINED(map->array[index]))
+        return false;
+    map->array[index] = UNDEFINED_VAL;
+    map->array_count--;
+    while (map->array_length > 0 && IS_UNDEFINED(map->array[map->array_length - 1]))
+        map->array_length--;
+    if (map->array_length > 8 && map->array_count * 4 < map->array_length)
+        map_array_demote(map, vm);
+    return true;
+}
+
+bool
+objmap_entry_at(ObjMap* map, uint32_t i, Entry* entry)
+{
+    ASSERT(map->resize == NULL, "iterating over a map being resized");
+    if (i < map->array_length) {
+        if (IS_UNDEFINED(map->array[i])) return false;
+        entry->key = NUMBER_TO_VAL(i);
+        entry->value = map->array[i];
+        return true;
+    }
+    i -= map->array_length;
+    if (i >= map->length || IS_UNDEFINED(map->entries[i].key))
+        return false;
+    *entry = map->entries[i];
+    return true;
 }
 
 void
 objmap_free(VM* vm, Obj* obj)
 {
     ObjMap* map = (ObjMap*)obj;
+    memory_realloc(vm, map->entries, map_alloc_size(map->capacity), 0);
+    FREE_ARRAY(vm, map->array, Value, map->array_capacity);
+    if (map->resize != NULL)
+        map_resize_end(map, vm);
+    FREE_OBJECT(vm, ObjMap, map);
+}
+
+// ObjWeakRef
+// ==========
+
+ObjWeakRef*
+objweakref_new(VM* vm, Value target)
+{
+    ObjWeakRef* ref = ALLOCATE_OBJECT(vm, OBJ_WEAKREF, ObjWeakRef);
+    ref->target = target;
+    return ref;
+}
+
+void
+objweakref_free(VM* vm, Obj* obj)
+{
+    FREE_OBJECT(vm, ObjWeakRef, obj);
+}
+
+// ObjWeakMap
+// ==========
+
+ObjWeakMap*
+objweakmap_new(VM* vm)
+{
+    ObjWeakMap* map = ALLOCATE_OBJECT(vm, OBJ_WEAKMAP, ObjWeakMap);
+    table_init(&map->tbl);
+    return map;
+}
+
+bool
+objweakmap_get(ObjWeakMap* map, Value key, Value* val)
+{
+    return table_get(&map->tbl, key, val);
+}
+
+bool
+objweakmap_set(ObjWeakMap* map, VM* vm, Value key, Value val)
+{
+    bool is_new_key = table_set(&map->tbl, vm, key, val);
+    memory_barrier(vm, (Obj*)map);
+    return is_new_key;
+}
+
+bool
+objweakmap_delete(ObjWeakMap* map, VM* vm, Value key)
+{
+    return table_delete(&map->tbl, vm, key);
+}
+
+void
+objweakmap_free(VM* vm, Obj* obj)
+{
+    ObjWeakMap* map = (ObjWeakMap*)obj;
     table_free(&map->tbl, vm);
-    FREE(vm, ObjMap, map);
+    FREE_OBJECT(vm, ObjWeakMap, map);
 }
 
 // ObjMsg
@@ -612,7 +1343,7 @@ objmsg_new(VM* vm, ObjString* slot_name, Value* args, uint32_t num_args)
 void
 objmsg_free(VM* vm, Obj* obj)
 {
-    FREE(vm, ObjMsg, (ObjMsg*)obj);
+    FREE_OBJECT(vm, ObjMsg, (ObjMsg*)obj);
 }
 
 ObjMsg*
@@ -650,5 +1381,5 @@ objforeign_free(VM* vm, Obj* obj)
     ObjForeign* handle = (ObjForeign*)obj;
     if (handle->gc != NULL)
         handle->gc(vm, handle->p);
-    FREE(vm, ObjForeign, handle);
+    FREE_OBJECT(vm, ObjForeign, handle);
 }
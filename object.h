@@ -24,6 +24,8 @@ typedef struct VM VM;
 #define IS_MAP(value)         (is_object_type(value, OBJ_MAP))
 #define IS_MSG(value)         (is_object_type(value, OBJ_MSG))
 #define IS_FOREIGN(value)     (is_object_type(value, OBJ_FOREIGN))
+#define IS_WEAKREF(value)     (is_object_type(value, OBJ_WEAKREF))
+#define IS_WEAKMAP(value)     (is_object_type(value, OBJ_WEAKMAP))
 
 #define VAL_TO_STRING(value)  ((ObjString*)VAL_TO_OBJ(value))
 #define VAL_TO_FN(value)      ((ObjFn*)VAL_TO_OBJ(value))
@@ -37,6 +39,8 @@ typedef struct VM VM;
 #define VAL_TO_MAP(value)     ((ObjMap*)VAL_TO_OBJ(value))
 #define VAL_TO_MSG(value)     ((ObjMsg*)VAL_TO_OBJ(value))
 #define VAL_TO_FOREIGN(value) ((ObjForeign*)VAL_TO_OBJ(value))
+#define VAL_TO_WEAKREF(value) ((ObjWeakRef*)VAL_TO_OBJ(value))
+#define VAL_TO_WEAKMAP(value) ((ObjWeakMap*)VAL_TO_OBJ(value))
 
 typedef enum {
     OBJ_STRING,
@@ -51,13 +55,16 @@ typedef enum {
     OBJ_MAP,
     OBJ_MSG,
     OBJ_FOREIGN,
+    OBJ_WEAKREF,
+    OBJ_WEAKMAP,
+    OBJ_SHAPE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_SHAPE + 1)
+
 typedef struct Obj {
     ObjType type;
-    bool visited;     // Have we already visited this object?
-    bool marked;      // Does this object have a live reference?
-    struct Obj* next; // Link to the next allocated object.
+    bool remembered; // Is this object in vm->remembered?
 } Obj;
 
 static inline bool
@@ -101,11 +108,49 @@ typedef struct {
     uint8_t upvalue_count;
 } ObjClosure;
 
+// Objects that got their slots added in the same order share a Shape,
+// which maps each slot's key to an index into ObjObject->values.
+// Shapes form a tree rooted at vm->root_shape: adding a slot follows
+// (or creates) a transition to a child shape. Transitions are weak;
+// a shape only lives as long as some object (or child) uses it.
+#define SHAPE_MAX_SLOTS       32
+#define SHAPE_MAX_TRANSITIONS 64
+
+typedef struct Shape {
+    Obj obj;
+    struct Shape* parent;
+    Value* keys; // keys[i] is the key of slot i.
+    uint32_t count;
+    Table transitions; // key -> Shape
+} Shape;
+
+// Objects with up to this many slots keep them inline.
+#define OBJECT_INLINE_SLOTS 4
+
 typedef struct {
     Obj obj;
-    Value* protos;
+    Value* protos; // Points to inline_proto unless there are several.
     uint32_t protos_count;
+    uint32_t values_capacity;
+    // Slots are stored in `values` according to `shape`, or in the
+    // `slots` table if shape is NULL (dictionary mode). Objects switch
+    // to dictionary mode when they get too many slots, or when a slot
+    // is deleted. `values` points to `inline_values` until the object
+    // has more than OBJECT_INLINE_SLOTS slots.
+    Shape* shape;
+    Value* values;
     Table slots;
+    Value inline_values[OBJECT_INLINE_SLOTS];
+    Value inline_proto;
+    // The linearized ancestors of this object, see ancestors() in vm.c.
+    // Valid while ancestors_epoch matches vm->proto_epoch.
+    Value* ancestors;
+    uint32_t ancestors_count;
+    uint32_t ancestors_capacity;
+    uint32_t ancestors_epoch;
+    // Has an inline cache looked at this object? If so, changing the
+    // layout of its slots or protos must invalidate the caches.
+    bool watched;
 } ObjObject;
 
 typedef bool (*NativeFn)(VM* vm, void* ctx, Value* args, int num_args);
@@ -163,13 +208,45 @@ typedef struct ObjList {
     Value* values;
     uint32_t size;
     uint32_t capacity;
+    // If the list is remembered (see memory_barrier), only the values
+    // from this index on can point to young objects. A minor collection
+    // then doesn't have to look at the rest of a long list.
+    uint32_t dirty;
 } ObjList;
 
+// Maps keep their entries in insertion order, in a dense array
+// followed by a hash index into it (see object.c). Deleted entries
+// keep their place, with an UNDEFINED key, until the map is rebuilt.
+// Keys 0 to array_length - 1 are kept in `array` instead, by index
+// (UNDEFINED for the missing ones), and iterated over first.
+//
+// Large hash parts are resized a few entries at a time: `resize`
+// holds the old one until all its entries have been moved over.
+typedef struct {
+    Entry* entries;
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t next;  // The next old entry to move.
+    uint32_t moved; // Entries moved so far, to the start of the new part.
+    uint32_t kept;  // Entries kept for them (the rest are deleted).
+} MapResize;
+
 typedef struct ObjMap {
     Obj obj;
-    Table tbl;
+    Entry* entries;
+    uint32_t count;    // Entries that aren't deleted.
+    uint32_t length;   // Entries used, deleted ones included.
+    uint32_t capacity; // Slots in the index (a power of 2), see MAP_USABLE.
+    uint32_t array_count; // Keys in `array`.
+    Value* array;
+    uint32_t array_length;
+    uint32_t array_capacity;
+    MapResize* resize; // NULL unless resizing.
 } ObjMap;
 
+// How many entries fit in a map with this capacity.
+#define MAP_USABLE(capacity) ((capacity) / 4 * 3)
+
 // ObjMsg represents a (mutable) "call", for example
 // a.b(c,d,e) <-> ObjMsg{slot_name=b, args=[c,d,e]}
 typedef struct {
@@ -178,6 +255,20 @@ typedef struct {
     ObjList* args;
 } ObjMsg;
 
+// Doesn't keep `target` alive: it's set to nil once the target is
+// collected.
+typedef struct {
+    Obj obj;
+    Value target;
+} ObjWeakRef;
+
+// A map whose entries are ephemerons: an entry only keeps its value
+// alive while its key is alive (and goes away with the key).
+typedef struct {
+    Obj obj;
+    Table tbl;
+} ObjWeakMap;
+
 typedef void (*GCFn)(VM* vm, void* p);
 
 typedef struct {
@@ -193,6 +284,7 @@ typedef struct {
 
 Obj* object_allocate(VM* vm, ObjType type, size_t sz);
 void object_free(Obj* obj, VM* vm);
+const char* object_type_name(ObjType type);
 
 #define ALLOCATE_OBJECT(vm, obj_type, type) \
     (type*)object_allocate(vm, obj_type, sizeof(type))
@@ -222,6 +314,18 @@ ObjUpvalue* objupvalue_new(VM* vm, Value* slot);
 
 ObjClosure* objclosure_new(VM* vm, ObjFn* fn);
 
+// Shape
+// =====
+
+Shape* shape_new(VM* vm, Shape* parent, Value key);
+// Returns the index of `key` in shape, or -1 if it's not there.
+int shape_find(Shape* shape, Value key);
+// Returns the shape with `key` added after the slots of `shape`, or
+// NULL if objects shouldn't use shapes for that many slots.
+Shape* shape_add(Shape* shape, VM* vm, Value key);
+// Drop the transitions to unmarked shapes (called during a GC).
+void shape_remove_white(Shape* shape, VM* vm);
+
 // ObjObject
 // =========
 
@@ -232,6 +336,7 @@ void objobject_delete_proto(ObjObject* obj, VM* vm, Value proto);
 void objobject_copy_protos(ObjObject* obj, VM* vm, Value* protos, uint32_t length);
 bool objobject_has(ObjObject* obj, Value key);
 bool objobject_get(ObjObject* obj, Value key, Value* result);
+Value* objobject_find(ObjObject* obj, Value key);
 void objobject_set(ObjObject* obj, VM* vm, Value key, Value value);
 bool objobject_delete(ObjObject* obj, VM* vm, Value key);
 
@@ -254,13 +359,20 @@ bool objfiber_is_done(ObjFiber* fiber);
 // ========
 
 ObjRange* objrange_new(VM* vm, double start, double end, bool inclusive);
+// Range's iterMore: returns the number after `iter` in the range
+// start..end (or start...end), or the first one if `iter` is nil,
+// or false if there isn't one.
+Value range_iter_more(double start, double end, bool inclusive, Value iter);
+
+// iterMore for sequences indexed by 0 .. length-1 (List, String).
+Value sequence_iter_more(Value iter, uint32_t length);
 
 // ObjList
 // =======
 
 ObjList* objlist_new(VM* vm, uint32_t size);
 Value objlist_get(ObjList* list, uint32_t idx);
-void objlist_set(ObjList* list, uint32_t idx, Value v);
+void objlist_set(ObjList* list, VM* vm, uint32_t idx, Value v);
 void objlist_del(ObjList* list, VM* vm, uint32_t idx);
 void objlist_insert(ObjList* list, VM* vm, uint32_t idx, Value v);
 
@@ -272,6 +384,37 @@ bool objmap_has(ObjMap* map, Value key);
 bool objmap_get(ObjMap* map, Value key, Value* value);
 bool objmap_set(ObjMap* map, VM* vm, Value key, Value value);
 bool objmap_delete(ObjMap* map, VM* vm, Value key);
+// Iterating: positions 0 to objmap_end(map) - 1 go through the array
+// part, then the entries. Returns false if there's nothing at `i`.
+bool objmap_entry_at(ObjMap* map, uint32_t i, Entry* entry);
+// Moves over the rest of the old entries at once, which has to be
+// done before iterating.
+void objmap_finish_resize(ObjMap* map, VM* vm);
+
+static inline uint32_t
+objmap_end(ObjMap* map)
+{
+    return map->array_length + map->length;
+}
+
+static inline uint32_t
+objmap_length(ObjMap* map)
+{
+    return map->array_count + map->count;
+}
+
+// ObjWeakRef
+// ==========
+
+ObjWeakRef* objweakref_new(VM* vm, Value target);
+
+// ObjWeakMap
+// ==========
+
+ObjWeakMap* objweakmap_new(VM* vm);
+bool objweakmap_get(ObjWeakMap* map, Value key, Value* value);
+bool objweakmap_set(ObjWeakMap* map, VM* vm, Value key, Value value);
+bool objweakmap_delete(ObjWeakMap* map, VM* vm, Value key);
 
 // ObjMsg
 // ======
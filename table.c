@@ -3,7 +3,93 @@
 #include "value.h"
 #include "vm.h"
 
-#include <string.h>  // memcmp
+#include <string.h>  // memcmp, memset
+
+#if defined(__SSE2__) && !defined(SUBTLE_NO_SIMD)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+// Open addressing with a control byte per entry, as in SwissTable.
+// The control byte of a full entry holds the low 7 bits of its key's
+// hash (h2), and the rest of the hash (h1) picks the group of
+// GROUP_SIZE entries that probing starts from. The control bytes of
+// a whole group are compared with h2 at once, so value_equal is only
+// called on likely matches. Probing stops at the first group with an
+// empty entry, and moves on to the next group otherwise (1, 2, 3...
+// groups further along, which visits every group).
+//
+// The control bytes follow the entries, with at least a group's worth
+// of them even in smaller tables. Then comes the number of entries
+// that can still be filled, see growth_left.
+
+#define GROUP_SIZE   16
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xfe
+
+#ifdef SUBTLE_DEBUG_TABLE_STATS
+size_t table_lookups = 0;
+size_t table_probes = 0;
+#define COUNT_LOOKUP() (table_lookups++)
+#define COUNT_PROBE()  (table_probes++)
+#else
+#define COUNT_LOOKUP() ((void)0)
+#define COUNT_PROBE()  ((void)0)
+#endif
+
+// Bit i is set for the i-th entry of a group.
+typedef uint32_t GroupMask;
+
+static inline GroupMask group_match(const uint8_t* group, uint8_t byte) {
+#ifdef TABLE_SSE2
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        if (group[i] == byte) mask |= (GroupMask)1 << i;
+    return mask;
+#endif
+}
+
+// Empty entries and tombstones, the only ones with the top bit set.
+static inline GroupMask group_match_free(const uint8_t* group) {
+#ifdef TABLE_SSE2
+    return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        if (group[i] & 0x80) mask |= (GroupMask)1 << i;
+    return mask;
+#endif
+}
+
+static inline uint32_t ctrl_size(uint32_t capacity) {
+    return capacity < GROUP_SIZE ? GROUP_SIZE : capacity;
+}
+
+static inline uint32_t group_count(uint32_t capacity) {
+    return capacity < GROUP_SIZE ? 1 : capacity / GROUP_SIZE;
+}
+
+static inline size_t alloc_size(uint32_t capacity) {
+    if (capacity == 0) return 0;
+    return sizeof(Entry) * capacity + ctrl_size(capacity) + sizeof(uint32_t);
+}
+
+static inline uint8_t* table_ctrl(const Table* table) {
+    return (uint8_t*)(table->entries + table->capacity);
+}
+
+// Entries that can be filled before the table has to be rehashed:
+// tombstones count as filled, since probing can't stop at them.
+static inline uint32_t* growth_left(const Table* table) {
+    return (uint32_t*)(table_ctrl(table) + ctrl_size(table->capacity));
+}
+
+static inline uint8_t hash_h2(uint32_t hash) {
+    return hash & 0x7f;
+}
 
 void table_init(Table* table) {
     table->entries = NULL;
@@ -12,82 +98,123 @@ void table_init(Table* table) {
 }
 
 void table_free(Table* table, VM* vm) {
-    FREE_ARRAY(vm, table->entries, Entry, table->capacity);
+    memory_realloc(vm, table->entries, alloc_size(table->capacity), 0);
     table_init(table);
 }
 
-static Entry* table_find_entry(Entry* entries, uint32_t capacity, Value key) {
-    uint32_t index = value_hash(key) & (capacity - 1);
-    uint32_t start = index;
-    Entry* tombstone = NULL;
-    do {
-        Entry* entry = &entries[index];
-        if (IS_UNDEFINED(entry->key)) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry
-                return tombstone == NULL ? entry : tombstone;
-            } else {
-                // Tombstone entry
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        } else if (value_equal(entry->key, key)) {
-            // Found the key.
-            return entry;
+static Entry* table_find_entry(const Table* table, Value key, uint32_t hash) {
+    const uint8_t* ctrl = table_ctrl(table);
+    uint32_t mask = group_count(table->capacity) - 1;
+    uint32_t group = (hash >> 7) & mask;
+    uint8_t h2 = hash_h2(hash);
+    COUNT_LOOKUP();
+    for (uint32_t i = 1; i <= mask + 1; i++) {
+        COUNT_PROBE();
+        const uint8_t* g = ctrl + group * GROUP_SIZE;
+        // Past `capacity`, small tables' control bytes are empty, so
+        // they never match.
+        GroupMask match = group_match(g, h2);
+        while (match != 0) {
+            Entry* entry = &table->entries[group * GROUP_SIZE + __builtin_ctz(match)];
+            if (value_equal(entry->key, key))
+                return entry;
+            match &= match - 1;
         }
-        index = (index + 1) & (capacity - 1);
-    } while (index != start);
-    ASSERT(tombstone != NULL, "Table should have empty values or tombstones.");
-    return tombstone;
+        if (group_match(g, CTRL_EMPTY) != 0)
+            return NULL;
+        group = (group + i) & mask;
+    }
+    return NULL;
+}
+
+// Returns the index of the first empty entry or tombstone that a key
+// with this hash would be probed for. There has to be one.
+static uint32_t table_find_free(const Table* table, uint32_t hash) {
+    const uint8_t* ctrl = table_ctrl(table);
+    uint32_t mask = group_count(table->capacity) - 1;
+    uint32_t group = (hash >> 7) & mask;
+    GroupMask valid = table->capacity < GROUP_SIZE
+        ? ((GroupMask)1 << table->capacity) - 1
+        : 0xffff;
+    for (uint32_t i = 1;; i++) {
+        GroupMask free = group_match_free(ctrl + group * GROUP_SIZE) & valid;
+        if (free != 0)
+            return group * GROUP_SIZE + __builtin_ctz(free);
+        ASSERT(i <= mask, "table has no free entry");
+        group = (group + i) & mask;
+    }
 }
 
 static void table_adjust_capacity(Table* table, VM* vm, uint32_t capacity) {
-    Entry* entries = ALLOCATE_ARRAY(vm, Entry, capacity);
+    Entry* entries = memory_realloc(vm, NULL, 0, alloc_size(capacity));
+    Table resized = { entries, table->count, capacity };
     for (uint32_t i = 0; i < capacity; i++) {
         entries[i].key = UNDEFINED_VAL;
         entries[i].value = NIL_VAL;
     }
+    uint8_t* ctrl = table_ctrl(&resized);
+    memset(ctrl, CTRL_EMPTY, ctrl_size(capacity));
+    *growth_left(&resized) = (uint32_t)(capacity * TABLE_MAX_LOAD) - table->count;
 
     for (uint32_t i = 0; i < table->capacity; i++) {
         Entry* src = &table->entries[i];
         if (IS_UNDEFINED(src->key)) continue;
 
-        Entry* dst = table_find_entry(entries, capacity, src->key);
-        ASSERT(IS_UNDEFINED(dst->key) && IS_NIL(dst->value), "dst is not empty");
-        dst->key = src->key;
-        dst->value = src->value;
+        uint32_t hash = value_hash(src->key);
+        uint32_t index = table_find_free(&resized, hash);
+        ctrl[index] = hash_h2(hash);
+        entries[index] = *src;
     }
 
-    FREE_ARRAY(vm, table->entries, Entry, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    memory_realloc(vm, table->entries, alloc_size(table->capacity), 0);
+    *table = resized;
 }
 
 bool table_get(Table* table, Value key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = table_find_entry(table->entries, table->capacity, key);
-    if (IS_UNDEFINED(entry->key)) return false;
+    Entry* entry = table_find_entry(table, key, value_hash(key));
+    if (entry == NULL) return false;
 
     *value = entry->value;
     return true;
 }
 
+Value* table_find(Table* table, Value key) {
+    if (table->count == 0) return NULL;
+
+    Entry* entry = table_find_entry(table, key, value_hash(key));
+    if (entry == NULL) return NULL;
+    return &entry->value;
+}
+
 bool table_set(Table* table, VM* vm, Value key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        uint32_t new_capacity = GROW_CAPACITY(table->capacity);
-        table_adjust_capacity(table, vm, new_capacity);
+    uint32_t hash = value_hash(key);
+    if (table->count > 0) {
+        Entry* entry = table_find_entry(table, key, hash);
+        if (entry != NULL) {
+            entry->value = value;
+            return false;
+        }
     }
 
-    Entry* entry = table_find_entry(table->entries, table->capacity, key);
-    bool is_new_key = IS_UNDEFINED(entry->key);
-    if (is_new_key)
-        table->count++;
-
-    entry->key = key;
-    entry->value = value;
+    if (table->capacity == 0 || *growth_left(table) == 0) {
+        // Grow, unless there are enough tombstones to get rid of.
+        uint32_t capacity = table->count + 1 > table->capacity * TABLE_MAX_LOAD
+            ? GROW_CAPACITY(table->capacity)
+            : table->capacity;
+        table_adjust_capacity(table, vm, capacity);
+    }
 
-    return is_new_key;
+    uint32_t index = table_find_free(table, hash);
+    uint8_t* ctrl = table_ctrl(table);
+    if (ctrl[index] == CTRL_EMPTY)
+        (*growth_left(table))--;
+    ctrl[index] = hash_h2(hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+    return true;
 }
 
 static
@@ -105,16 +232,32 @@ void table_compact(Table* table, VM* vm) {
     ASSERT(table->count <= table->capacity * TABLE_MAX_LOAD, "count < max_load");
 }
 
+void
+table_remove_entry(Table* table, Entry* entry)
+{
+    uint32_t index = (uint32_t)(entry - table->entries);
+    uint8_t* ctrl = table_ctrl(table);
+    // A group with an empty entry left has never been full, so no key
+    // was probed past it: the entry can be empty again, instead of a
+    // tombstone.
+    if (group_match(ctrl + index / GROUP_SIZE * GROUP_SIZE, CTRL_EMPTY) != 0) {
+        ctrl[index] = CTRL_EMPTY;
+        (*growth_left(table))++;
+    } else {
+        ctrl[index] = CTRL_DELETED;
+    }
+    entry->key = UNDEFINED_VAL;
+    entry->value = NIL_VAL;
+    table->count--;
+}
+
 bool table_delete(Table* table, VM* vm, Value key) {
     if (table->count == 0) return false;
 
-    Entry* entry = table_find_entry(table->entries, table->capacity, key);
-    if (IS_UNDEFINED(entry->key)) return false;
+    Entry* entry = table_find_entry(table, key, value_hash(key));
+    if (entry == NULL) return false;
 
-    // Leave a tombstone.
-    entry->key = UNDEFINED_VAL;
-    entry->value = UNDEFINED_VAL;
-    table->count--;
+    table_remove_entry(table, entry);
     table_compact(table, vm);
     return true;
 }
@@ -124,22 +267,31 @@ table_find_string(Table* table,
                   const char* chars, size_t length, uint32_t hash)
 {
     if (table->count == 0) return NULL;
-    uint32_t index = hash & (table->capacity - 1);
-    uint32_t start = index;
-    do {
-        Entry* entry = &table->entries[index];
-        if (IS_UNDEFINED(entry->key)) {
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (IS_STRING(entry->key)) {
-            ObjString* str = VAL_TO_STRING(entry->key);
-            if (str->hash == hash
-                    && str->length == length
-                    && memcmp(str->chars, chars, length) == 0) {
-                return str;
+    const uint8_t* ctrl = table_ctrl(table);
+    uint32_t mask = group_count(table->capacity) - 1;
+    uint32_t group = (hash >> 7) & mask;
+    uint8_t h2 = hash_h2(hash);
+    COUNT_LOOKUP();
+    for (uint32_t i = 1; i <= mask + 1; i++) {
+        COUNT_PROBE();
+        const uint8_t* g = ctrl + group * GROUP_SIZE;
+        GroupMask match = group_match(g, h2);
+        while (match != 0) {
+            Value key = table->entries[group * GROUP_SIZE + __builtin_ctz(match)].key;
+            if (IS_STRING(key)) {
+                ObjString* str = VAL_TO_STRING(key);
+                if (str->hash == hash
+                        && str->length == length
+                        && memcmp(str->chars, chars, length) == 0) {
+                    return str;
+                }
             }
+            match &= match - 1;
         }
-        index = (index + 1) & (table->capacity - 1);
-    } while (index != start);
+        if (group_match(g, CTRL_EMPTY) != 0)
+            return NULL;
+        group = (group + i) & mask;
+    }
     return NULL;
 }
 
@@ -153,16 +305,21 @@ table_mark(Table* table, VM* vm)
     }
 }
 
+void
+table_remove_key(Table* table, Value key)
+{
+    if (table->count == 0) return;
+    Entry* entry = table_find_entry(table, key, value_hash(key));
+    if (entry != NULL)
+        table_remove_entry(table, entry);
+}
+
 void
 table_remove_white(Table* table, VM* vm)
 {
     for (uint32_t i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (IS_OBJ(entry->key) && !VAL_TO_OBJ(entry->key)->marked) {
-            // Leave a tombstone.
-            entry->key = UNDEFINED_VAL;
-            entry->value = UNDEFINED_VAL;
-            table->count--;
-        }
+        if (IS_OBJ(entry->key) && !is_marked(vm, VAL_TO_OBJ(entry->key)))
+            table_remove_entry(table, entry);
     }
 }
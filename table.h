@@ -6,10 +6,9 @@
 
 #define TABLE_MAX_LOAD 0.75
 
-// Entries can be in 3 possible states:
-//  1. !IS_UNDEFINED(key)                   -- the entry is valid (holds a key-value pair).
-//  2.  IS_UNDEFINED(key) &&  IS_NIL(value) -- the entry is empty.
-//  3.  IS_UNDEFINED(key) && !IS_NIL(value) -- the entry is a tombstone.
+// An entry holds a key-value pair unless its key is UNDEFINED. Whether
+// a free entry is empty or a tombstone is only recorded in the table's
+// control bytes, see table.c.
 typedef struct {
     Value key;
     Value value;
@@ -19,6 +18,10 @@ typedef struct {
 typedef struct VM VM;
 typedef struct ObjString ObjString;
 
+// `entries` has `capacity` entries (a power of 2), followed by the
+// control bytes in the same allocation. Code outside table.c may
+// iterate over the entries, but has to use table_remove_entry to
+// remove them.
 typedef struct {
     Entry* entries;
     uint32_t count;
@@ -28,11 +31,26 @@ typedef struct {
 void table_init(Table* table);
 void table_free(Table* table, VM* vm);
 bool table_get(Table* table, Value key, Value* value);
+// Returns a pointer to the value stored under `key`, or NULL if the
+// key is not in the table. The pointer is only valid until the next
+// insertion or deletion.
+Value* table_find(Table* table, Value key);
 bool table_set(Table* table, VM* vm, Value key, Value value);
 bool table_delete(Table* table, VM* vm, Value key);
 ObjString* table_find_string(Table* table,
                              const char* str, size_t length, uint32_t hash);
 void table_mark(Table* table, VM* vm);
+// These never resize the table, so they're safe to call in the
+// middle of a collection.
+void table_remove_key(Table* table, Value key);
+void table_remove_entry(Table* table, Entry* entry);
 void table_remove_white(Table* table, VM* vm);
 
+#ifdef SUBTLE_DEBUG_TABLE_STATS
+// Lookups done by any table, and the groups of control bytes they
+// looked at, for bench/table.c.
+extern size_t table_lookups;
+extern size_t table_probes;
+#endif
+
 #endif
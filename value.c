@@ -61,7 +61,7 @@ static uint32_t object_hash(Obj* obj)
 }
 
 uint32_t value_hash(Value v) {
-    switch (v.type) {
+    switch (VALUE_TYPE(v)) {
         case VALUE_NIL:    return 0xa3b1799d;
         case VALUE_TRUE:   return 0x46685257;
         case VALUE_FALSE:  return 0x392456de;
@@ -72,8 +72,8 @@ uint32_t value_hash(Value v) {
 }
 
 bool value_equal(Value a, Value b) {
-    if (a.type != b.type) return false;
-    switch (a.type) {
+    if (VALUE_TYPE(a) != VALUE_TYPE(b)) return false;
+    switch (VALUE_TYPE(a)) {
         case VALUE_NUMBER: return VAL_TO_NUMBER(a) == VAL_TO_NUMBER(b);
         case VALUE_OBJ:    return VAL_TO_OBJ(a) == VAL_TO_OBJ(b);
         default:           return true;
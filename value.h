@@ -8,26 +8,6 @@
 typedef struct VM VM;
 typedef struct Obj Obj;
 
-// Macros
-// ------
-#define IS_UNDEFINED(value)  ((value).type == VALUE_UNDEFINED)
-#define IS_NIL(value)        ((value).type == VALUE_NIL)
-#define IS_TRUE(value)       ((value).type == VALUE_TRUE)
-#define IS_FALSE(value)      ((value).type == VALUE_FALSE)
-#define IS_NUMBER(value)     ((value).type == VALUE_NUMBER)
-#define IS_OBJ(value)        ((value).type == VALUE_OBJ)
-
-#define VAL_TO_NUMBER(value) ((value).as.number)
-#define VAL_TO_OBJ(value)    ((value).as.obj)
-
-#define UNDEFINED_VAL    ((Value){VALUE_UNDEFINED, {.number = 0}})
-#define NIL_VAL          ((Value){VALUE_NIL,       {.number = 0}})
-#define TRUE_VAL         ((Value){VALUE_TRUE,      {.number = 0}})
-#define FALSE_VAL        ((Value){VALUE_FALSE,     {.number = 0}})
-#define BOOL_TO_VAL(b)   ((b) ? TRUE_VAL : FALSE_VAL)
-#define NUMBER_TO_VAL(n) ((Value){VALUE_NUMBER,    {.number = n}})
-#define OBJ_TO_VAL(p)    ((Value){VALUE_OBJ,       {.obj = (Obj*)p}})
-
 // There are two kinds of `objects`, those that live on the stack
 // (Values), and those that live on the heap (Objects) -- these are
 // pointed to by Values.
@@ -41,6 +21,80 @@ typedef enum {
     VALUE_OBJ,
 } ValueType;
 
+#ifdef SUBTLE_NAN_BOXING
+
+// NaN boxing
+// ----------
+// Values are 64 bits. Any double that isn't one of our quiet NaNs is
+// a number. Otherwise the low bits hold either a tag (for undefined,
+// nil, true and false) or, if the sign bit is set, an Obj*. This
+// relies on pointers fitting in the 48-bit mantissa.
+
+#if UINTPTR_MAX != UINT64_MAX
+    #error "SUBTLE_NAN_BOXING needs 64-bit pointers."
+#endif
+
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+// The tags are VALUE_* + 1, so that value_type() is cheap.
+#define TAG_UNDEFINED 1
+#define TAG_NIL       2
+#define TAG_TRUE      3
+#define TAG_FALSE     4
+
+#define IS_UNDEFINED(value)  ((value) == UNDEFINED_VAL)
+#define IS_NIL(value)        ((value) == NIL_VAL)
+#define IS_TRUE(value)       ((value) == TRUE_VAL)
+#define IS_FALSE(value)      ((value) == FALSE_VAL)
+#define IS_NUMBER(value)     (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)        (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define VAL_TO_NUMBER(value) value_to_number(value)
+#define VAL_TO_OBJ(value)    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define VALUE_TYPE(value)    value_type(value)
+
+#define UNDEFINED_VAL    ((Value)(QNAN | TAG_UNDEFINED))
+#define NIL_VAL          ((Value)(QNAN | TAG_NIL))
+#define TRUE_VAL         ((Value)(QNAN | TAG_TRUE))
+#define FALSE_VAL        ((Value)(QNAN | TAG_FALSE))
+#define BOOL_TO_VAL(b)   ((b) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_TO_VAL(n) number_to_value(n)
+#define OBJ_TO_VAL(p)    ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(p)))
+
+typedef union {
+    double   num;
+    uint64_t bits;
+} ValueBits;
+
+static inline double
+value_to_number(Value value)
+{
+    ValueBits data;
+    data.bits = value;
+    return data.num;
+}
+
+static inline Value
+number_to_value(double num)
+{
+    ValueBits data;
+    data.num = num;
+    return data.bits;
+}
+
+static inline ValueType
+value_type(Value value)
+{
+    if (IS_NUMBER(value)) return VALUE_NUMBER;
+    if (IS_OBJ(value))    return VALUE_OBJ;
+    return (ValueType)((value & 7) - 1);
+}
+
+#else
+
 typedef struct {
     ValueType type;
     union {
@@ -49,6 +103,27 @@ typedef struct {
     } as;
 } Value;
 
+#define IS_UNDEFINED(value)  ((value).type == VALUE_UNDEFINED)
+#define IS_NIL(value)        ((value).type == VALUE_NIL)
+#define IS_TRUE(value)       ((value).type == VALUE_TRUE)
+#define IS_FALSE(value)      ((value).type == VALUE_FALSE)
+#define IS_NUMBER(value)     ((value).type == VALUE_NUMBER)
+#define IS_OBJ(value)        ((value).type == VALUE_OBJ)
+
+#define VAL_TO_NUMBER(value) ((value).as.number)
+#define VAL_TO_OBJ(value)    ((value).as.obj)
+#define VALUE_TYPE(value)    ((value).type)
+
+#define UNDEFINED_VAL    ((Value){VALUE_UNDEFINED, {.number = 0}})
+#define NIL_VAL          ((Value){VALUE_NIL,       {.number = 0}})
+#define TRUE_VAL         ((Value){VALUE_TRUE,      {.number = 0}})
+#define FALSE_VAL        ((Value){VALUE_FALSE,     {.number = 0}})
+#define BOOL_TO_VAL(b)   ((b) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_TO_VAL(n) ((Value){VALUE_NUMBER,    {.number = n}})
+#define OBJ_TO_VAL(p)    ((Value){VALUE_OBJ,       {.obj = (Obj*)p}})
+
+#endif
+
 typedef struct {
     Value* values;
     uint32_t length;
@@ -33,35 +33,81 @@ void vm_init(VM* vm) {
     vm->ListProto = NULL;
     vm->MapProto = NULL;
     vm->MsgProto = NULL;
+    vm->WeakRefProto = NULL;
+    vm->WeakMapProto = NULL;
+    vm->root_shape = NULL;
+
+    vm->ic_epoch = 0;
+    vm->proto_epoch = 1;
+    for (int i = 0; i < INTRINSIC_COUNT; i++) {
+        vm->intrinsics[i].proto = NULL;
+        vm->intrinsics[i].name = NULL;
+        vm->intrinsics[i].native = NULL;
+        vm->intrinsics[i].slot = NULL;
+        vm->intrinsics[i].epoch = 0;
+    }
 
     vm->uid = 0;
     vm->handles = NULL;
     vm->extensions = NULL;
-    vm->objects = NULL;
+    vm->young_pages = NULL;
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        vm->size_classes[i] = (SizeClass){NULL, NULL, NULL, NULL};
+    vm->sweep_class = 0;
+    vm->sweep_epoch = 0;
+    vm->region_pages = NULL;
+    vm->free_pages = NULL;
+    vm->free_pages_count = 0;
+    vm->page_chunk = NULL;
+    vm->page_chunk_left = 0;
+    vm->region_depth = 0;
+    vm->region_major_count = 0;
+    vm->remembered = NULL;
+    vm->remembered_count = 0;
+    vm->remembered_capacity = 0;
+    vm->weak = NULL;
+    vm->weak_count = 0;
+    vm->weak_capacity = 0;
     vm->bytes_allocated = 0;
-    vm->next_gc = 1024 * 1024;
+    vm->gc_policy.min_heap = GC_MIN_HEAP;
+    vm->gc_policy.max_heap = 0;
+    vm->gc_policy.grow_factor = GC_GROW_FACTOR;
+    vm->gc_policy.target_overhead = GC_TARGET_OVERHEAD;
+    vm->gc_policy.target_pause = 0;
+    vm->next_gc = GC_MIN_HEAP;
+    vm->next_minor_gc = GC_NURSERY_SIZE;
+    vm->next_gc_step = 0;
+    vm->gc_step_work = GC_STEP_WORK;
+    vm->gc_phase = GC_IDLE;
+    vm->gc_threads = 1;
+    vm->gc_stats = (GCStats){0};
+    vm->gc_cycle_start = 0;
+    vm->gc_cycle_stats = (GCStats){0};
+    vm->gc_heap_start = 0;
     vm->gray_capacity = 0;
     vm->gray_count = 0;
     vm->gray_stack = NULL;
     vm->roots_count = 0;
 
     table_init(&vm->strings);
-    table_init(&vm->globals);
+    table_init(&vm->global_names);
+    valuearray_init(&vm->global_values);
 
     vm->compiler = NULL;
 }
 
 void vm_free(VM* vm) {
-    // Note: the loop below will free the *Proto fields.
-    Obj* obj = vm->objects;
-    while (obj != NULL) {
-        Obj* next = obj->next;
-        object_free(obj, vm);
-        obj = next;
-    }
+#ifdef SUBTLE_DEBUG_PRINT_GC_STATS
+    memory_print_stats(vm);
+#endif
+    // Note: this frees the *Proto fields too.
+    memory_free_objects(vm);
     table_free(&vm->strings, vm);
-    table_free(&vm->globals, vm);
+    table_free(&vm->global_names, vm);
+    valuearray_free(&vm->global_values, vm);
     free(vm->gray_stack);
+    free(vm->remembered);
+    free(vm->weak);
 
     ExtContext* ext = vm->extensions;
     while (ext != NULL) {
@@ -156,6 +202,7 @@ handle_error(VM* vm, ObjFiber* until, int level)
     // error value to the parent.
     while (fiber != NULL) {
         fiber->error = error;
+        memory_barrier(vm, (Obj*)fiber);
         if (fiber == until && level != -1) return false;
         if (fiber->state == FIBER_TRY) {
             fiber->parent->stack_top[-1] = OBJ_TO_VAL(error);
@@ -256,18 +303,20 @@ capture_upvalue(VM* vm, Value* local)
         vm->fiber->open_upvalues = created;
     } else {
         prev->next = created;
+        memory_barrier(vm, (Obj*)prev);
     }
     return created;
 }
 
 static void
-close_upvalues(ObjFiber* fiber, Value* last)
+close_upvalues(VM* vm, ObjFiber* fiber, Value* last)
 {
     while (fiber->open_upvalues != NULL
            && fiber->open_upvalues->location >= last) {
         ObjUpvalue* upvalue = fiber->open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        memory_barrier(vm, (Obj*)upvalue);
         fiber->open_upvalues = upvalue->next;
     }
 }
@@ -275,7 +324,7 @@ close_upvalues(ObjFiber* fiber, Value* last)
 Value
 vm_get_prototype(VM* vm, Value value)
 {
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VALUE_NIL:
         case VALUE_TRUE:
         case VALUE_FALSE:
@@ -293,6 +342,8 @@ vm_get_prototype(VM* vm, Value value)
                 case OBJ_LIST:    return OBJ_TO_VAL(vm->ListProto);
                 case OBJ_MAP:     return OBJ_TO_VAL(vm->MapProto);
                 case OBJ_MSG:     return OBJ_TO_VAL(vm->MsgProto);
+                case OBJ_WEAKREF: return OBJ_TO_VAL(vm->WeakRefProto);
+                case OBJ_WEAKMAP: return OBJ_TO_VAL(vm->WeakMapProto);
                 case OBJ_FOREIGN: return VAL_TO_FOREIGN(value)->proto;
                 default: UNREACHABLE();
             }
@@ -301,50 +352,174 @@ vm_get_prototype(VM* vm, Value value)
     }
 }
 
+// Where does a lookup on a non-ObjObject value continue?
+static inline ObjObject*
+lookup_object(VM* vm, Value src)
+{
+    while (!IS_OBJECT(src))
+        src = vm_get_prototype(vm, src);
+    return VAL_TO_OBJECT(src);
+}
+
+// Appends `src` and its ancestors (depth-first, in the order of the
+// protos) to object->ancestors, skipping anything already there.
+static void
+linearize(VM* vm, ObjObject* object, Value src)
+{
+    for (uint32_t i = 0; i < object->ancestors_count; i++)
+        if (value_equal(object->ancestors[i], src))
+            return;
+
+    if (object->ancestors_count + 1 > object->ancestors_capacity) {
+        // Lookups happen in places where a GC isn't safe, so (like
+        // the gray stack) this doesn't go through memory_realloc.
+        uint32_t capacity = object->ancestors_capacity < 4 ? 4 : object->ancestors_capacity * 2;
+        Value* ancestors = realloc(object->ancestors, sizeof(Value) * capacity);
+        if (ancestors == NULL) {
+            perror("linearize: cannot allocate ancestors");
+            exit(1);
+        }
+        object->ancestors = ancestors;
+        object->ancestors_capacity = capacity;
+    }
+    object->ancestors[object->ancestors_count++] = src;
+
+    if (IS_OBJECT(src)) {
+        ObjObject* obj = VAL_TO_OBJECT(src);
+        for (uint32_t i = 0; i < obj->protos_count; i++)
+            linearize(vm, object, obj->protos[i]);
+    } else {
+        linearize(vm, object, vm_get_prototype(vm, src));
+    }
+}
+
+// Returns every value a lookup starting at `object` visits, in order
+// and without duplicates, so that lookups are a flat loop even with
+// multiple inheritance and cycles. ancestors[0] is the object itself.
+static Value*
+ancestors(VM* vm, ObjObject* object, uint32_t* count)
+{
+    if (object->ancestors_epoch != vm->proto_epoch) {
+        object->ancestors_epoch = vm->proto_epoch;
+        object->ancestors_count = 0;
+        linearize(vm, object, OBJ_TO_VAL(object));
+    }
+    *count = object->ancestors_count;
+    return object->ancestors;
+}
+
+// Returns what a lookup on `object` visits after the object itself.
+static inline Value*
+proto_chain(VM* vm, ObjObject* object, uint32_t* count)
+{
+    // Objects with a single proto (most of them) share its list. If
+    // object is part of a cycle it shows up again in there, which is
+    // harmless.
+    if (object->protos_count == 1 && IS_OBJECT(object->protos[0]))
+        return ancestors(vm, VAL_TO_OBJECT(object->protos[0]), count);
+    Value* chain = ancestors(vm, object, count);
+    (*count)--;
+    return chain + 1;
+}
+
+// Find where the slot named `slot_name` lives, starting from `src`.
+// If `watch` is true, every object visited is marked as watched, as
+// the result may be remembered by an inline cache.
+static Value*
+find_slot(VM* vm, Value src, Value slot_name, bool watch)
+{
+    ObjObject* object = lookup_object(vm, src);
+    if (watch)
+        object->watched = true;
+    Value* slot = objobject_find(object, slot_name);
+    if (slot != NULL || object->protos_count == 0)
+        return slot;
+
+    uint32_t count;
+    Value* chain = proto_chain(vm, object, &count);
+    for (uint32_t i = 0; i < count; i++) {
+        // Other values are followed by their prototype.
+        if (!IS_OBJECT(chain[i])) continue;
+        ObjObject* ancestor = VAL_TO_OBJECT(chain[i]);
+        if (watch)
+            ancestor->watched = true;
+        if ((slot = objobject_find(ancestor, slot_name)) != NULL)
+            return slot;
+    }
+    return NULL;
+}
+
 bool
 vm_get_slot(VM* vm, Value src, Value slot_name, Value* slot_value)
 {
-    // We don't mark non-ObjObject values as their prototypes
-    // are well-known and can only be given by vm_get_prototype.
-    if (IS_OBJECT(src)) {
-        Obj* obj = VAL_TO_OBJ(src);
-        if (obj->visited) return false;
+    Value* slot = find_slot(vm, src, slot_name, false);
+    if (slot == NULL)
+        return false;
+    *slot_value = *slot;
+    return true;
+}
 
-        // First do a lookup on the object itself.
-        ObjObject* object = (ObjObject*)obj;
-        if (objobject_get(object, slot_name, slot_value))
-            return true;
+void
+vm_add_intrinsic(VM* vm, IntrinsicType type, ObjObject* proto, const char* name)
+{
+    Intrinsic* intrinsic = &vm->intrinsics[type];
+    intrinsic->proto = proto;
+    intrinsic->name = objstring_copy(vm, name, strlen(name));
+    intrinsic->slot = find_slot(vm, OBJ_TO_VAL(proto), OBJ_TO_VAL(intrinsic->name), true);
+    intrinsic->epoch = vm->ic_epoch;
+    ASSERT(intrinsic->slot != NULL && IS_NATIVE(*intrinsic->slot), "Intrinsic is not a native.");
+    intrinsic->native = VAL_TO_NATIVE(*intrinsic->slot);
+}
 
-        // Then do the multiple inheritance.
-        bool found = false;
-        obj->visited = true;
-        for (int i = 0; i < object->protos_count; i++)
-            if ((found = vm_get_slot(vm, object->protos[i], slot_name, slot_value)))
-                break;
-        obj->visited = false;
-        return found;
+// Can we inline the given intrinsic? i.e. does the lookup still find
+// the original native?
+static inline bool
+intrinsic_ok(VM* vm, IntrinsicType type)
+{
+    Intrinsic* intrinsic = &vm->intrinsics[type];
+    if (intrinsic->epoch != vm->ic_epoch) {
+        if (intrinsic->native == NULL) return false;
+        intrinsic->epoch = vm->ic_epoch;
+        intrinsic->slot = find_slot(vm,
+                                    OBJ_TO_VAL(intrinsic->proto),
+                                    OBJ_TO_VAL(intrinsic->name),
+                                    true);
     }
-    return vm_get_slot(vm, vm_get_prototype(vm, src), slot_name, slot_value);
+    return intrinsic->slot != NULL
+        && IS_OBJ(*intrinsic->slot)
+        && VAL_TO_OBJ(*intrinsic->slot) == (Obj*)intrinsic->native;
+}
+
+// Same as intrinsic_ok, but picks the intrinsic according to the
+// type of the (primitive) receiver.
+static inline bool
+primitive_intrinsic_ok(VM* vm, Value receiver,
+                       IntrinsicType number, IntrinsicType string, IntrinsicType object)
+{
+    if (IS_NUMBER(receiver)) return intrinsic_ok(vm, number);
+    if (IS_STRING(receiver)) return intrinsic_ok(vm, string);
+    if (!IS_OBJ(receiver))   return intrinsic_ok(vm, object);
+    return false;
 }
 
 bool
 vm_has_ancestor(VM* vm, Value src, Value ancestor)
 {
+    while (!IS_OBJECT(src)) {
+        if (value_equal(src, ancestor)) return true;
+        src = vm_get_prototype(vm, src);
+    }
     if (value_equal(src, ancestor)) return true;
-    if (IS_OBJECT(src)) {
-        Obj* obj = VAL_TO_OBJ(src);
-        if (obj->visited) return false;
 
-        ObjObject* object = (ObjObject*)obj;
-        bool found = false;
-        obj->visited = true;
-        for (int i = 0; i < object->protos_count; i++)
-            if ((found = vm_has_ancestor(vm, object->protos[i], ancestor)))
-                break;
-        obj->visited = false;
-        return found;
-    }
-    return vm_has_ancestor(vm, vm_get_prototype(vm, src), ancestor);
+    ObjObject* object = VAL_TO_OBJECT(src);
+    if (object->protos_count == 0)
+        return false;
+    uint32_t count;
+    Value* chain = proto_chain(vm, object, &count);
+    for (uint32_t i = 0; i < count; i++)
+        if (value_equal(chain[i], ancestor))
+            return true;
+    return false;
 }
 
 typedef bool (*CompleteCallFn)(VM* vm, Value slot, int num_args);
@@ -400,218 +575,713 @@ vm_invoke(VM* vm, Value obj, ObjString* slot_name, int num_args)
     return generic_invoke(vm, obj, slot_name, num_args, vm_call);
 }
 
+// Where does a slot lookup on `obj` start? This is what the inline
+// caches are keyed on. Returns NULL if the lookup can't be cached.
+static inline Obj*
+lookup_start(VM* vm, Value obj)
+{
+    if (IS_OBJECT(obj))
+        return VAL_TO_OBJ(obj);
+    Value proto = vm_get_prototype(vm, obj);
+    return IS_OBJECT(proto) ? VAL_TO_OBJ(proto) : NULL;
+}
+
+// Returns the entry of cache that should be (re)filled next.
+static inline ICEntry*
+cache_add(InlineCache* cache)
+{
+    // Once the cache is full, keep replacing the last entry.
+    int idx = cache->count < IC_SIZE ? cache->count++ : IC_SIZE - 1;
+    return &cache->entries[idx];
+}
+
+// Looks up slot_name on an object with a shape. The cache entry only
+// remembers the shape, so it is shared by every object built the same
+// way: either the slot is one of the object's own (at ->index), or the
+// object has a single proto (->klass) where the slot was found. The
+// object itself doesn't need to be watched, since adding or deleting
+// its slots changes its shape.
+// Returns NULL if the lookup can't be cached this way.
+static inline Value*
+shape_cache_lookup(VM* vm, InlineCache* cache,
+                   ObjObject* object, Value slot_name)
+{
+    Shape* shape = object->shape;
+    Obj* proto = object->protos_count == 1 && IS_OBJECT(object->protos[0])
+        ? VAL_TO_OBJ(object->protos[0])
+        : NULL;
+
+    for (int i = 0; i < cache->count; i++) {
+        ICEntry* entry = &cache->entries[i];
+        if (entry->shape != shape) continue;
+        if (entry->klass == NULL) return &object->values[entry->index];
+        if (entry->klass == proto) return entry->slot;
+    }
+
+    Value* slot;
+    int index = shape_find(shape, slot_name);
+    if (index >= 0) {
+        proto = NULL;
+        slot = &object->values[index];
+    } else if (proto != NULL) {
+        slot = find_slot(vm, OBJ_TO_VAL(proto), slot_name, true);
+        if (slot == NULL)
+            return NULL;
+    } else {
+        return NULL;
+    }
+
+    ICEntry* entry = cache_add(cache);
+    entry->klass = proto;
+    entry->shape = shape;
+    entry->slot = slot;
+    entry->index = index < 0 ? 0 : (uint32_t)index;
+    return slot;
+}
+
+// Looks up slot_name on obj, keying the cache on where the lookup
+// starts. Returns NULL if the lookup can't be cached, or fails.
+static inline Value*
+klass_cache_lookup(VM* vm, InlineCache* cache, Value obj, Value slot_name)
+{
+    Obj* klass = lookup_start(vm, obj);
+    if (klass == NULL)
+        return NULL;
+
+    for (int i = 0; i < cache->count; i++) {
+        ICEntry* entry = &cache->entries[i];
+        if (entry->shape == NULL && entry->klass == klass)
+            return entry->slot;
+    }
+
+    Value* slot = find_slot(vm, OBJ_TO_VAL(klass), slot_name, true);
+    if (slot == NULL)
+        return NULL;
+
+    ICEntry* entry = cache_add(cache);
+    entry->klass = klass;
+    entry->shape = NULL;
+    entry->slot = slot;
+    entry->index = 0;
+    return slot;
+}
+
+// Same as generic_invoke(..., vm_complete_call), but first consults
+// (and fills) the call site's inline cache.
+static bool
+cached_invoke(VM* vm, InlineCache* cache,
+              Value obj, ObjString* slot_name, int num_args)
+{
+    if (cache->epoch != vm->ic_epoch) {
+        cache->epoch = vm->ic_epoch;
+        cache->count = 0;
+    }
+
+    Value* slot = NULL;
+    if (IS_OBJECT(obj) && VAL_TO_OBJECT(obj)->shape != NULL)
+        slot = shape_cache_lookup(vm, cache, VAL_TO_OBJECT(obj), OBJ_TO_VAL(slot_name));
+    if (slot == NULL)
+        slot = klass_cache_lookup(vm, cache, obj, OBJ_TO_VAL(slot_name));
+    // Leave the forwarding (and error) path to generic_invoke.
+    if (slot == NULL)
+        return generic_invoke(vm, obj, slot_name, num_args, vm_complete_call);
+
+    Value callee = *slot;
+    if (!vm_check_call(vm, callee, num_args, slot_name))
+        return false;
+    return vm_complete_call(vm, callee, num_args);
+}
+
+// Checks that `v` is an in-bounds, non-negative integer index into a
+// sequence of `length` items.
+static inline bool
+sequence_index(Value v, uint32_t length, uint32_t* idx)
+{
+    if (!IS_NUMBER(v)) return false;
+    double d = VAL_TO_NUMBER(v);
+    if (!(d >= 0 && d < length)) return false;
+    *idx = (uint32_t) d;
+    return *idx == d;
+}
+
+// Finds the name of the global at `index`. This is slow, so it
+// should only be used for error messages.
+static ObjString*
+global_name(VM* vm, int index)
+{
+    Table* names = &vm->global_names;
+    for (uint32_t i = 0; i < names->capacity; i++) {
+        Entry* entry = &names->entries[i];
+        if (!IS_UNDEFINED(entry->key)
+                && VAL_TO_NUMBER(entry->value) == index)
+            return VAL_TO_STRING(entry->key);
+    }
+    UNREACHABLE();
+}
+
+#ifdef SUBTLE_DEBUG_TRACE_EXECUTION
+static void
+trace_instruction(ObjFiber* fiber, CallFrame* frame, uint8_t* ip, Value* stack_top)
+{
+    // Trace the stack.
+    for (Value* vptr = fiber->stack; vptr != stack_top; vptr++) {
+        printf("[ ");
+        debug_print_value(*vptr);
+        printf(" ]");
+    }
+    printf("\n");
+    // Trace the about-to-be-executed instruction.
+    debug_print_instruction(&frame->closure->fn->chunk,
+                            ip - frame->closure->fn->chunk.code);
+}
+#endif
+
+#ifdef SUBTLE_COMPUTED_GOTO
+// Labels as values are not ISO C.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// GCC likes to merge the `goto *`s at the end of every instruction
+// back into a single jump, which defeats the point of computed gotos.
+#if defined(SUBTLE_COMPUTED_GOTO) && !defined(__clang__)
+#define RUN_ATTRIBUTES __attribute__((optimize("no-gcse", "no-crossjumping")))
+#else
+#define RUN_ATTRIBUTES
+#endif
+
 // Run the given fiber until fiber->frames_count == top_level.
-static InterpretResult
+static InterpretResult RUN_ATTRIBUTES
 run(VM* vm, ObjFiber* fiber, int top_level)
 {
     ObjFiber* original_fiber = fiber;
     CallFrame* frame;
-
-#define REFRESH_FRAME() (frame = &vm->fiber->frames[vm->fiber->frames_count - 1])
-#define READ_BYTE() (*frame->ip++)
+    int num_args;
+
+    // Local copies of the hot parts of the current frame and fiber,
+    // so that the compiler can keep them in registers. Anything that
+    // can look at the frame or the stack (calls, allocations, errors)
+    // must be preceded by STORE_FRAME(), and followed by a
+    // REFRESH_FRAME() if it can push frames or switch fibers.
+    uint8_t* ip;
+    Value* stack_top;
+    Value* slots;
+    Value* constants;
+
+#define STORE_FRAME() \
+    (frame->ip = ip, \
+     fiber->stack_top = stack_top)
+#define REFRESH_FRAME() \
+    do { \
+        fiber = vm->fiber; \
+        frame = &fiber->frames[fiber->frames_count - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->fn->chunk.constants.values; \
+        stack_top = fiber->stack_top; \
+    } while (false)
+
+#define PUSH(value)    (*stack_top++ = (value))
+#define POP()          (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+#define DROP(count)    (stack_top -= (count))
+
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, \
-     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->fn->chunk.constants.values[READ_SHORT()])
+    (ip += 2, \
+     (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_SHORT()])
+#define READ_CACHE()    (&frame->closure->fn->chunk.caches[READ_SHORT()])
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        vm_runtime_error(vm, __VA_ARGS__); \
+        goto handle_fibers; \
+    } while (false)
+
+    // The operator and iteration instructions replace their operands
+    // with `result` and skip over their own operands (the slot name and
+    // the inline cache) if the fast path applies.
+#define OPERATOR_RESULT(arity, result) \
+    { \
+        Value _result = (result); \
+        DROP(arity); \
+        stack_top[-1] = _result; \
+        ip += 4; \
+        DISPATCH(); \
+    }
+#define NUMBER_OPERATOR(intrinsic, type, op, to_val) \
+    if (IS_NUMBER(PEEK(1)) && IS_NUMBER(PEEK(0)) \
+            && intrinsic_ok(vm, intrinsic)) { \
+        type a = (type)VAL_TO_NUMBER(PEEK(1)); \
+        type b = (type)VAL_TO_NUMBER(PEEK(0)); \
+        OPERATOR_RESULT(1, to_val(a op b)); \
+    }
+#define STRING_OPERATOR(intrinsic, op) \
+    if (IS_STRING(PEEK(1)) && IS_STRING(PEEK(0)) \
+            && intrinsic_ok(vm, intrinsic)) { \
+        const char* a = VAL_TO_STRING(PEEK(1))->chars; \
+        const char* b = VAL_TO_STRING(PEEK(0))->chars; \
+        OPERATOR_RESULT(1, BOOL_TO_VAL(strcmp(a, b) op 0)); \
+    }
 
-    // Actually start running the code here.
-    REFRESH_FRAME();
+    // With computed gotos every instruction jumps straight to the
+    // handler of the next one, instead of going back to a switch.
+    // This gives the branch predictor one indirect jump per opcode
+    // rather than a single shared one.
+#ifdef SUBTLE_COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        [OP_RETURN]        = &&op_OP_RETURN,
+        [OP_CONSTANT]      = &&op_OP_CONSTANT,
+        [OP_POP]           = &&op_OP_POP,
+        [OP_TRUE]          = &&op_OP_TRUE,
+        [OP_FALSE]         = &&op_OP_FALSE,
+        [OP_NIL]           = &&op_OP_NIL,
+        [OP_DEF_GLOBAL]    = &&op_OP_DEF_GLOBAL,
+        [OP_GET_GLOBAL]    = &&op_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]    = &&op_OP_SET_GLOBAL,
+        [OP_ASSERT]        = &&op_OP_ASSERT,
+        [OP_GET_LOCAL]     = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL]     = &&op_OP_SET_LOCAL,
+        [OP_LOOP]          = &&op_OP_LOOP,
+        [OP_JUMP]          = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_OR]            = &&op_OP_OR,
+        [OP_AND]           = &&op_OP_AND,
+        [OP_CLOSURE]       = &&op_OP_CLOSURE,
+        [OP_GET_UPVALUE]   = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]   = &&op_OP_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_OBJECT]        = &&op_OP_OBJECT,
+        [OP_OBJLIT_SET]    = &&op_OP_OBJLIT_SET,
+        [OP_INVOKE]        = &&op_OP_INVOKE,
+        [OP_ADD]           = &&op_OP_ADD,
+        [OP_SUB]           = &&op_OP_SUB,
+        [OP_MUL]           = &&op_OP_MUL,
+        [OP_DIV]           = &&op_OP_DIV,
+        [OP_LT]            = &&op_OP_LT,
+        [OP_LEQ]           = &&op_OP_LEQ,
+        [OP_GT]            = &&op_OP_GT,
+        [OP_GEQ]           = &&op_OP_GEQ,
+        [OP_EQ]            = &&op_OP_EQ,
+        [OP_NEQ]           = &&op_OP_NEQ,
+        [OP_BIT_AND]       = &&op_OP_BIT_AND,
+        [OP_BIT_OR]        = &&op_OP_BIT_OR,
+        [OP_NEG]           = &&op_OP_NEG,
+        [OP_NOT]           = &&op_OP_NOT,
+        [OP_ITER_MORE]     = &&op_OP_ITER_MORE,
+        [OP_ITER_NEXT]     = &&op_OP_ITER_NEXT,
+        [OP_RANGE]         = &&op_OP_RANGE,
+        [OP_RANGE_MORE]    = &&op_OP_RANGE_MORE,
+        [OP_RANGE_NEXT]    = &&op_OP_RANGE_NEXT,
+    };
+#define CASE(op)   op_##op
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatch_table[READ_BYTE()]; \
+    } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#else
+#define CASE(op)   case op
+#define DISPATCH() goto loop
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        switch (READ_BYTE())
+#endif
 
-    for (;;) {
 #ifdef SUBTLE_DEBUG_TRACE_EXECUTION
-        // Trace the stack.
-        for (Value* vptr = vm->fiber->stack; vptr != vm->fiber->stack_top; vptr++) {
-            printf("[ ");
-            debug_print_value(*vptr);
-            printf(" ]");
-        }
-        printf("\n");
-        // Trace the about-to-be-executed instruction.
-        debug_print_instruction(&frame->closure->fn->chunk,
-                                frame->ip - frame->closure->fn->chunk.code);
+#define TRACE_INSTRUCTION() trace_instruction(fiber, frame, ip, stack_top)
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
 #endif
-        switch (READ_BYTE()) {
-            case OP_RETURN: {
-                Value result = vm_pop(vm);
-                close_upvalues(fiber, frame->slots);
-                fiber->frames_count--;
-                fiber->stack_top = frame->slots;
-                if (fiber == original_fiber && fiber->frames_count == top_level) {
-                    vm_push(vm, result);
-                    return INTERPRET_OK;
-                }
-                if (objfiber_is_done(fiber)) {
-                    // Transfer control to the parent fiber.
-                    fiber = fiber->parent;
-                    vm->fiber = fiber;
-                    if (fiber == NULL)
-                       return INTERPRET_OK; // Nothing to do?
-                    fiber->stack_top[-1] = result;
-                    REFRESH_FRAME();
-                } else {
-                    vm_push(vm, result);
-                    REFRESH_FRAME();
-                }
-                break;
-            }
-            case OP_CONSTANT: vm_push(vm, READ_CONSTANT()); break;
-            case OP_POP:      vm_pop(vm); break;
-            case OP_TRUE:     vm_push(vm, TRUE_VAL); break;
-            case OP_FALSE:    vm_push(vm, FALSE_VAL); break;
-            case OP_NIL:      vm_push(vm, NIL_VAL); break;
-            case OP_DEF_GLOBAL: {
-                Value name = READ_CONSTANT();
-                table_set(&vm->globals, vm, name, vm_peek(vm, 0));
-                vm_pop(vm);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                Value name = READ_CONSTANT();
-                Value value;
-                if (!table_get(&vm->globals, name, &value)) {
-                    vm_runtime_error(vm, "Undefined variable '%s'.", VAL_TO_STRING(name)->chars);
-                    goto handle_fibers;
-                }
-                vm_push(vm, value);
-                break;
+
+    // Actually start running the code here.
+    REFRESH_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_RETURN): {
+            Value result = POP();
+            close_upvalues(vm, fiber, slots);
+            fiber->frames_count--;
+            fiber->stack_top = slots;
+            if (fiber == original_fiber && fiber->frames_count == top_level) {
+                vm_push(vm, result);
+                return INTERPRET_OK;
             }
-            case OP_SET_GLOBAL: {
-                Value name = READ_CONSTANT();
-                if (table_set(&vm->globals, vm, name, vm_peek(vm, 0))) {
-                    table_delete(&vm->globals, vm, name);
-                    vm_runtime_error(vm, "Undefined variable '%s'.", VAL_TO_STRING(name)->chars);
-                    goto handle_fibers;
-                }
-                break;
+            if (objfiber_is_done(fiber)) {
+                // Transfer control to the parent fiber.
+                memory_barrier(vm, (Obj*)fiber);
+                fiber = fiber->parent;
+                vm->fiber = fiber;
+                if (fiber == NULL)
+                   return INTERPRET_OK; // Nothing to do?
+                fiber->stack_top[-1] = result;
+                REFRESH_FRAME();
+            } else {
+                vm_push(vm, result);
+                REFRESH_FRAME();
             }
-            case OP_ASSERT: {
-                if (!value_truthy(vm_pop(vm))) {
-                    vm_runtime_error(vm, "Assertion failed.");
-                    goto handle_fibers;
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT): PUSH(READ_CONSTANT()); DISPATCH();
+        CASE(OP_POP):      DROP(1); DISPATCH();
+        CASE(OP_TRUE):     PUSH(TRUE_VAL); DISPATCH();
+        CASE(OP_FALSE):    PUSH(FALSE_VAL); DISPATCH();
+        CASE(OP_NIL):      PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_DEF_GLOBAL): {
+            uint16_t index = READ_SHORT();
+            vm->global_values.values[index] = POP();
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t index = READ_SHORT();
+            Value value = vm->global_values.values[index];
+            if (IS_UNDEFINED(value))
+                RUNTIME_ERROR("Undefined variable '%s'.", global_name(vm, index)->chars);
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t index = READ_SHORT();
+            Value* value = &vm->global_values.values[index];
+            if (IS_UNDEFINED(*value))
+                RUNTIME_ERROR("Undefined variable '%s'.", global_name(vm, index)->chars);
+            *value = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_ASSERT): {
+            if (!value_truthy(POP()))
+                RUNTIME_ERROR("Assertion failed.");
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (!value_truthy(POP()))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_OR): {
+            uint16_t offset = READ_SHORT();
+            if (value_truthy(PEEK(0)))
+                ip += offset;
+            else
+                DROP(1);
+            DISPATCH();
+        }
+        CASE(OP_AND): {
+            uint16_t offset = READ_SHORT();
+            if (!value_truthy(PEEK(0)))
+                ip += offset;
+            else
+                DROP(1);
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            ObjFn* fn = VAL_TO_FN(READ_CONSTANT());
+            STORE_FRAME();
+            ObjClosure* closure = objclosure_new(vm, fn);
+            PUSH(OBJ_TO_VAL(closure));
+            STORE_FRAME(); // capture_upvalue can allocate.
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                uint8_t is_local = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (is_local) {
+                    // If it's a local upvalue, then the captured value
+                    // can be found in the current frame.
+                    closure->upvalues[i] = capture_upvalue(vm, slots + index);
+                } else {
+                    // Otherwise, the non-local upvalue should be
+                    // captured by this frame's upvalues (the compiler
+                    // should add one upvalue to this function).
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                break;
+                memory_barrier(vm, (Obj*)closure);
             }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                vm_push(vm, frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = vm_peek(vm, 0);
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = PEEK(0);
+            if (upvalue->location == &upvalue->closed)
+                memory_barrier(vm, (Obj*)upvalue);
+            else
+                memory_barrier_value(vm, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE): {
+            close_upvalues(vm, fiber, stack_top - 1);
+            DROP(1);
+            DISPATCH();
+        }
+        CASE(OP_OBJECT): {
+            STORE_FRAME();
+            ObjObject* object = objobject_new(vm);
+            PUSH(OBJ_TO_VAL(object));
+            STORE_FRAME();
+            objobject_set_proto(object, vm, OBJ_TO_VAL(vm->ObjectProto));
+            DISPATCH();
+        }
+        CASE(OP_OBJLIT_SET): {
+            Value key = READ_CONSTANT();
+            Value obj = PEEK(1);
+            Value value = PEEK(0);
+            STORE_FRAME();
+            objobject_set(VAL_TO_OBJECT(obj), vm, key, value);
+            DROP(1); // value
+            DISPATCH();
+        }
+        CASE(OP_ADD):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_ADD, double, +, NUMBER_TO_VAL);
+            if (IS_STRING(PEEK(1)) && IS_STRING(PEEK(0))
+                    && intrinsic_ok(vm, INTRINSIC_STRING_ADD)) {
+                // The operands stay on the stack until we're done,
+                // in case objstring_concat triggers a GC.
+                STORE_FRAME();
+                OPERATOR_RESULT(1, OBJ_TO_VAL(objstring_concat(vm,
+                    VAL_TO_STRING(PEEK(1)),
+                    VAL_TO_STRING(PEEK(0)))));
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (!value_truthy(vm_pop(vm)))
-                    frame->ip += offset;
-                break;
+            num_args = 1;
+            goto invoke;
+        CASE(OP_SUB):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_SUB, double, -, NUMBER_TO_VAL);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_MUL):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_MUL, double, *, NUMBER_TO_VAL);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_DIV):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_DIV, double, /, NUMBER_TO_VAL);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_LT):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_LT, double, <, BOOL_TO_VAL);
+            STRING_OPERATOR(INTRINSIC_STRING_LT, <);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_LEQ):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_LEQ, double, <=, BOOL_TO_VAL);
+            STRING_OPERATOR(INTRINSIC_STRING_LEQ, <=);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_GT):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_GT, double, >, BOOL_TO_VAL);
+            STRING_OPERATOR(INTRINSIC_STRING_GT, >);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_GEQ):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_GEQ, double, >=, BOOL_TO_VAL);
+            STRING_OPERATOR(INTRINSIC_STRING_GEQ, >=);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_EQ):
+            if (primitive_intrinsic_ok(vm, PEEK(1),
+                                       INTRINSIC_NUMBER_EQ,
+                                       INTRINSIC_STRING_EQ,
+                                       INTRINSIC_OBJECT_EQ))
+                OPERATOR_RESULT(1, BOOL_TO_VAL(value_equal(PEEK(1), PEEK(0))));
+            num_args = 1;
+            goto invoke;
+        CASE(OP_NEQ):
+            if (primitive_intrinsic_ok(vm, PEEK(1),
+                                       INTRINSIC_NUMBER_NEQ,
+                                       INTRINSIC_STRING_NEQ,
+                                       INTRINSIC_OBJECT_NEQ))
+                OPERATOR_RESULT(1, BOOL_TO_VAL(!value_equal(PEEK(1), PEEK(0))));
+            num_args = 1;
+            goto invoke;
+        CASE(OP_BIT_AND):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_BIT_AND, int32_t, &, NUMBER_TO_VAL);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_BIT_OR):
+            NUMBER_OPERATOR(INTRINSIC_NUMBER_BIT_OR, int32_t, |, NUMBER_TO_VAL);
+            num_args = 1;
+            goto invoke;
+        CASE(OP_NEG):
+            if (IS_NUMBER(PEEK(0)) && intrinsic_ok(vm, INTRINSIC_NUMBER_NEG))
+                OPERATOR_RESULT(0, NUMBER_TO_VAL(-VAL_TO_NUMBER(PEEK(0))));
+            num_args = 0;
+            goto invoke;
+        CASE(OP_NOT):
+            if (primitive_intrinsic_ok(vm, PEEK(0),
+                                       INTRINSIC_NUMBER_NOT,
+                                       INTRINSIC_STRING_NOT,
+                                       INTRINSIC_OBJECT_NOT))
+                OPERATOR_RESULT(0, BOOL_TO_VAL(!value_truthy(PEEK(0))));
+            num_args = 0;
+            goto invoke;
+        CASE(OP_ITER_MORE): {
+            Value seq = PEEK(1);
+            Value iter = PEEK(0);
+            if (IS_LIST(seq) && intrinsic_ok(vm, INTRINSIC_LIST_ITER_MORE))
+                OPERATOR_RESULT(1, sequence_iter_more(iter, VAL_TO_LIST(seq)->size));
+            if (IS_RANGE(seq) && intrinsic_ok(vm, INTRINSIC_RANGE_ITER_MORE)) {
+                ObjRange* range = VAL_TO_RANGE(seq);
+                OPERATOR_RESULT(1, range_iter_more(range->start, range->end,
+                                                   range->inclusive, iter));
             }
-            case OP_OR: {
-                uint16_t offset = READ_SHORT();
-                if (value_truthy(vm_peek(vm, 0)))
-                    frame->ip += offset;
-                else
-                    vm_pop(vm);
-                break;
+            if (IS_STRING(seq) && intrinsic_ok(vm, INTRINSIC_STRING_ITER_MORE))
+                OPERATOR_RESULT(1, sequence_iter_more(iter, VAL_TO_STRING(seq)->length));
+            num_args = 1;
+            goto invoke;
+        }
+        CASE(OP_ITER_NEXT): {
+            // Only plain indices take the fast path; anything else
+            // (e.g. the sequence shrank during the loop) is left to
+            // the natives.
+            Value seq = PEEK(1);
+            Value iter = PEEK(0);
+            uint32_t idx;
+            if (IS_LIST(seq) && sequence_index(iter, VAL_TO_LIST(seq)->size, &idx)
+                    && intrinsic_ok(vm, INTRINSIC_LIST_ITER_NEXT))
+                OPERATOR_RESULT(1, objlist_get(VAL_TO_LIST(seq), idx));
+            if (IS_RANGE(seq) && IS_NUMBER(iter)
+                    && intrinsic_ok(vm, INTRINSIC_RANGE_ITER_NEXT))
+                OPERATOR_RESULT(1, iter);
+            if (IS_STRING(seq) && sequence_index(iter, VAL_TO_STRING(seq)->length, &idx)
+                    && intrinsic_ok(vm, INTRINSIC_STRING_ITER_NEXT)) {
+                STORE_FRAME();
+                OPERATOR_RESULT(1, OBJ_TO_VAL(objstring_copy(vm,
+                    VAL_TO_STRING(seq)->chars + idx, 1)));
             }
-            case OP_AND: {
-                uint16_t offset = READ_SHORT();
-                if (!value_truthy(vm_peek(vm, 0)))
-                    frame->ip += offset;
-                else
-                    vm_pop(vm);
-                break;
+            num_args = 1;
+            goto invoke;
+        }
+        CASE(OP_RANGE): {
+            bool inclusive = READ_BYTE();
+            IntrinsicType intrinsic = inclusive ? INTRINSIC_NUMBER_INCLUSIVE_RANGE
+                                                : INTRINSIC_NUMBER_EXCLUSIVE_RANGE;
+            if (IS_NUMBER(PEEK(1)) && IS_NUMBER(PEEK(0))
+                    && intrinsic_ok(vm, intrinsic)) {
+                ip += 4;
+                DISPATCH();
             }
-            case OP_CLOSURE: {
-                ObjFn* fn = VAL_TO_FN(READ_CONSTANT());
-                ObjClosure* closure = objclosure_new(vm, fn);
-                vm_push(vm, OBJ_TO_VAL(closure));
-                for (int i = 0; i < closure->upvalue_count; i++) {
-                    uint8_t is_local = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (is_local) {
-                        // If it's a local upvalue, then the captured value
-                        // can be found in the current frame.
-                        closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
-                    } else {
-                        // Otherwise, the non-local upvalue should be
-                        // captured by this frame's upvalues (the compiler
-                        // should add one upvalue to this function).
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
+            // Create the range for real: the stack goes from
+            // [start, end] to [nil, start, end], and the invoke
+            // leaves [nil, range].
+            Value end = POP();
+            Value start = POP();
+            PUSH(NIL_VAL);
+            PUSH(start);
+            PUSH(end);
+            num_args = 1;
+            goto invoke;
+        }
+        CASE(OP_RANGE_MORE):
+        CASE(OP_RANGE_NEXT): {
+            bool more = ip[-1] == OP_RANGE_MORE;
+            bool inclusive = READ_BYTE();
+            Value* locals = &slots[READ_BYTE()]; // start, end, iter
+            if (IS_NUMBER(locals[0])) {
+                if (more && intrinsic_ok(vm, INTRINSIC_RANGE_ITER_MORE)) {
+                    PUSH(range_iter_more(VAL_TO_NUMBER(locals[0]),
+                                         VAL_TO_NUMBER(locals[1]),
+                                         inclusive, locals[2]));
+                    ip += 4;
+                    DISPATCH();
                 }
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                vm_push(vm, *frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = vm_peek(vm, 0);
-                break;
-            }
-            case OP_CLOSE_UPVALUE: {
-                close_upvalues(fiber, fiber->stack_top - 1);
-                vm_pop(vm);
-                break;
-            }
-            case OP_OBJECT: {
-                ObjObject* object = objobject_new(vm);
-                vm_push(vm, OBJ_TO_VAL(object));
-                objobject_set_proto(object, vm, OBJ_TO_VAL(vm->ObjectProto));
-                break;
-            }
-            case OP_OBJLIT_SET: {
-                Value key = READ_CONSTANT();
-                Value obj = vm_peek(vm, 1);
-                Value value = vm_peek(vm, 0);
-                objobject_set(VAL_TO_OBJECT(obj), vm, key, value);
-                vm_pop(vm); // value
-                break;
-            }
-            case OP_INVOKE: {
-                Value key = READ_CONSTANT();
-                uint8_t num_args = READ_BYTE();
-                Value obj = vm_peek(vm, num_args);
-                // The stack is already in the correct form for a method call.
-                // We have `obj` followed by `num_args`.
-                generic_invoke(vm, obj,
-                               VAL_TO_STRING(key), num_args,
-                               vm_complete_call);
-handle_fibers:
-                fiber = vm->fiber;
-                if (fiber == NULL) return INTERPRET_OK;
-                if (fiber->error != NULL) {
-                    if (!handle_error(vm, original_fiber, top_level))
-                        return INTERPRET_RUNTIME_ERROR;
-                    fiber = vm->fiber;
+                if (!more && intrinsic_ok(vm, INTRINSIC_RANGE_ITER_NEXT)) {
+                    PUSH(locals[2]);
+                    ip += 4;
+                    DISPATCH();
                 }
-                REFRESH_FRAME();
-                break;
+                // Range's iterMore or iterNext was redefined, so
+                // we need a Range after all.
+                STORE_FRAME();
+                ObjRange* range = objrange_new(vm,
+                                               VAL_TO_NUMBER(locals[0]),
+                                               VAL_TO_NUMBER(locals[1]),
+                                               inclusive);
+                locals[0] = NIL_VAL;
+                locals[1] = OBJ_TO_VAL(range);
             }
-            default: UNREACHABLE();
+            PUSH(locals[1]);
+            PUSH(locals[2]);
+            num_args = 1;
+            goto invoke;
         }
+        CASE(OP_INVOKE):
+            num_args = READ_BYTE();
+        invoke: {
+            Value key = READ_CONSTANT();
+            InlineCache* cache = READ_CACHE();
+            Value obj = PEEK(num_args);
+            // The stack is already in the correct form for a method call.
+            // We have `obj` followed by `num_args`.
+            STORE_FRAME();
+            cached_invoke(vm, cache, obj, VAL_TO_STRING(key), num_args);
+handle_fibers:
+            if (vm->fiber == NULL) return INTERPRET_OK;
+            if (vm->fiber->error != NULL
+                    && !handle_error(vm, original_fiber, top_level))
+                return INTERPRET_RUNTIME_ERROR;
+            REFRESH_FRAME();
+            DISPATCH();
+        }
+#ifndef SUBTLE_COMPUTED_GOTO
+        default: UNREACHABLE();
+#endif
     }
+    UNREACHABLE();
 
+#undef STORE_FRAME
 #undef REFRESH_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef DROP
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
+#undef READ_CACHE
+#undef RUNTIME_ERROR
+#undef OPERATOR_RESULT
+#undef NUMBER_OPERATOR
+#undef STRING_OPERATOR
+#undef CASE
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef TRACE_INSTRUCTION
 }
 
+#undef RUN_ATTRIBUTES
+
+#ifdef SUBTLE_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
 bool
 vm_call(VM* vm, Value slot, int num_args)
 {
@@ -653,6 +1323,14 @@ vm_interpret(VM* vm, const char* source)
     return result;
 }
 
+GCStats
+vm_gc_stats(VM* vm)
+{
+    GCStats stats = vm->gc_stats;
+    stats.heap_size = vm->bytes_allocated;
+    return stats;
+}
+
 // Extension API
 // =============
 
@@ -667,12 +1345,26 @@ vm_add_global(VM* vm, char* name, Value v)
 {
     vm_push_root(vm, v);
     ObjString* s = objstring_copy(vm, name, strlen(name));
-    vm_push_root(vm, OBJ_TO_VAL(s));
-    table_set(&vm->globals, vm, OBJ_TO_VAL(s), v);
-    vm_pop_root(vm); // name
+    int index = vm_global_index(vm, s);
+    vm->global_values.values[index] = v;
     vm_pop_root(vm); // v
 }
 
+int
+vm_global_index(VM* vm, ObjString* name)
+{
+    Value index;
+    if (table_get(&vm->global_names, OBJ_TO_VAL(name), &index))
+        return (int)VAL_TO_NUMBER(index);
+
+    vm_push_root(vm, OBJ_TO_VAL(name));
+    valuearray_write(&vm->global_values, vm, UNDEFINED_VAL);
+    int rv = vm->global_values.length - 1;
+    table_set(&vm->global_names, vm, OBJ_TO_VAL(name), NUMBER_TO_VAL(rv));
+    vm_pop_root(vm);
+    return rv;
+}
+
 void
 vm_add_extension(VM *vm, void *p, GCFn free)
 {
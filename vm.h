@@ -24,6 +24,127 @@ typedef struct Handle {
     struct Handle* next;
 } Handle;
 
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,  // An incremental full collection is marking.
+    GC_SWEEPING, // The old objects left unmarked are being freed.
+} GCPhase;
+
+typedef struct {
+    size_t minor_count;
+    size_t major_count;
+    size_t major_steps; // Pauses taken by the major collections.
+    // Pause times, in seconds.
+    double minor_time;
+    double major_time;
+    double minor_max_pause;
+    double major_max_pause;
+    // Sweeping the old objects, which is done after marking.
+    size_t sweep_steps;
+    double sweep_time;
+    double sweep_max_pause;
+    // Bytes freed by minor and full collections.
+    size_t minor_freed;
+    size_t major_freed;
+    // Objects of each ObjType that haven't been freed yet, and the
+    // bytes they take (not counting the arrays they own).
+    size_t objects[OBJ_TYPE_COUNT];
+    size_t object_bytes[OBJ_TYPE_COUNT];
+    size_t heap_size; // vm->bytes_allocated, see vm_gc_stats.
+    // Measured over the last full collection cycle, see GCPolicy.
+    size_t bytes_allocated_total; // Ever allocated, not counting frees.
+    double alloc_rate;            // Bytes allocated per second of running.
+    double survival_rate;         // Share of the heap that was still alive.
+    double overhead;              // Share of the time spent collecting.
+    // Regions ended, and what became of their pages, see
+    // memory_end_region.
+    size_t region_count;
+    size_t region_pages_freed;
+    size_t region_pages_pinned;
+} GCStats;
+
+// How the heap grows, see memory_set_policy. After each full
+// collection, the next one is set to start once the heap has grown by
+// enough that collecting takes about `target_overhead` of the time,
+// judging from the last cycle's allocation rate and collection cost.
+// With a `target_overhead` of 0, it's `grow_factor` times the live
+// heap instead.
+typedef struct {
+    size_t min_heap;        // Never start a full collection below this,
+    size_t max_heap;        // nor wait for the heap to grow past this (0: no limit).
+    double grow_factor;
+    double target_overhead; // 0 to 1.
+    // If not 0, vm->gc_step_work is adjusted after each incremental
+    // collection so that its steps take about this many seconds.
+    double target_pause;
+} GCPolicy;
+
+// Objects are allocated from pages of SLAB_PAGE_SIZE bytes, holding
+// slots of a single size, see memory.c. Each multiple of SLAB_GRANULE
+// up to SLAB_MAX_SIZE has its own size class.
+#define SLAB_PAGE_SIZE (16 * 1024)
+#define SLAB_GRANULE   16
+#define SLAB_MAX_SIZE  256
+#define SLAB_CLASSES   (SLAB_MAX_SIZE / SLAB_GRANULE)
+
+typedef struct SlabPage SlabPage;
+
+typedef struct {
+    SlabPage* pages;     // Pages that have been swept.
+    SlabPage* unswept;   // Pages left to sweep after a full collection.
+    SlabPage* available; // Swept pages with free slots.
+    SlabPage* region;    // The page the current region bumps into.
+} SizeClass;
+
+// Intrinsics are core natives that the interpreter loop knows how to
+// inline. The loop may only do so while a lookup of `name` starting
+// from `proto` still finds `native`; the result of that lookup is
+// cached in `slot` (valid while `epoch` matches vm->ic_epoch).
+typedef enum {
+    INTRINSIC_NUMBER_ADD,
+    INTRINSIC_NUMBER_SUB,
+    INTRINSIC_NUMBER_MUL,
+    INTRINSIC_NUMBER_DIV,
+    INTRINSIC_NUMBER_LT,
+    INTRINSIC_NUMBER_LEQ,
+    INTRINSIC_NUMBER_GT,
+    INTRINSIC_NUMBER_GEQ,
+    INTRINSIC_NUMBER_EQ,
+    INTRINSIC_NUMBER_NEQ,
+    INTRINSIC_NUMBER_BIT_AND,
+    INTRINSIC_NUMBER_BIT_OR,
+    INTRINSIC_NUMBER_NEG,
+    INTRINSIC_NUMBER_NOT,
+    INTRINSIC_NUMBER_INCLUSIVE_RANGE,
+    INTRINSIC_NUMBER_EXCLUSIVE_RANGE,
+    INTRINSIC_STRING_ADD,
+    INTRINSIC_STRING_LT,
+    INTRINSIC_STRING_LEQ,
+    INTRINSIC_STRING_GT,
+    INTRINSIC_STRING_GEQ,
+    INTRINSIC_STRING_EQ,
+    INTRINSIC_STRING_NEQ,
+    INTRINSIC_STRING_NOT,
+    INTRINSIC_OBJECT_EQ,  // nil, true and false.
+    INTRINSIC_OBJECT_NEQ,
+    INTRINSIC_OBJECT_NOT,
+    INTRINSIC_LIST_ITER_MORE,
+    INTRINSIC_LIST_ITER_NEXT,
+    INTRINSIC_RANGE_ITER_MORE,
+    INTRINSIC_RANGE_ITER_NEXT,
+    INTRINSIC_STRING_ITER_MORE,
+    INTRINSIC_STRING_ITER_NEXT,
+    INTRINSIC_COUNT,
+} IntrinsicType;
+
+typedef struct {
+    ObjObject* proto;
+    ObjString* name;
+    ObjNative* native;
+    Value* slot;
+    uint32_t epoch;
+} Intrinsic;
+
 typedef struct ExtContext {
     // Opaque data that the extension owns.
     void* ctx;
@@ -57,6 +178,21 @@ typedef struct VM {
     ObjObject* ListProto;
     ObjObject* MapProto;
     ObjObject* MsgProto;
+    ObjObject* WeakRefProto;
+    ObjObject* WeakMapProto;
+    // -------------------------
+
+    // Every ObjObject starts out with this (empty) shape.
+    Shape* root_shape;
+
+    // ---- Inline caches ----
+    // Bumped whenever a watched object changes its layout (or a
+    // shape is freed), which invalidates every InlineCache at once.
+    uint32_t ic_epoch;
+    // Bumped whenever any object's protos change, which invalidates
+    // every object's linearized ancestors.
+    uint32_t proto_epoch;
+    Intrinsic intrinsics[INTRINSIC_COUNT];
     // -------------------------
 
     // ---- Extensions ----
@@ -66,9 +202,56 @@ typedef struct VM {
 
     // ---- GC ----
     Handle* handles;
-    Obj* objects;
+    // The GC is generational: pages that new objects were allocated
+    // in go on `young_pages`, and the unmarked objects in them are the
+    // young ones. Minor collections only look at those, plus the old
+    // objects in `remembered` (see memory_barrier). Between
+    // collections, every old object is marked.
+    // Mark bits live in a bitmap on each page, see is_marked. Full
+    // collections are incremental (see memory_start_collect): they
+    // clear every bitmap, so that every object is unmarked at once.
+    // Then the old objects are swept a few pages at a time, going
+    // through the size classes from sweep_class on. A page has been
+    // swept if its epoch matches sweep_epoch.
+    SlabPage* young_pages;
+    SizeClass size_classes[SLAB_CLASSES];
+    // Objects allocated inside a region (see memory_begin_region) are
+    // bumped out of pages of their own instead, which aren't on any
+    // of the lists above until the region ends.
+    SlabPage* region_pages;
+    // Pages not in use, and the rest of the last chunk mapped for
+    // them, see page_alloc.
+    SlabPage* free_pages;
+    uint32_t free_pages_count;
+    char* page_chunk;
+    uint32_t page_chunk_left;
+    int region_depth;
+    size_t region_major_count; // gc_stats.major_count when it began.
+    int sweep_class;
+    uint32_t sweep_epoch;
+    Obj** remembered;
+    int remembered_count;
+    int remembered_capacity;
+    // Weak references and weak maps blackened by the current
+    // collection, to be looked at again once marking is done.
+    Obj** weak;
+    int weak_count;
+    int weak_capacity;
     size_t bytes_allocated;
-    size_t next_gc;
+    size_t next_gc;       // Full collection when bytes_allocated reaches this.
+    size_t next_minor_gc; // Minor collection when bytes_allocated reaches this.
+    size_t next_gc_step;  // Step of the incremental collection, ditto.
+    size_t gc_step_work;  // About how many values each step marks (or
+                          // objects it sweeps).
+    GCPhase gc_phase;
+    int gc_threads;       // Threads that mark full collections (1 by default).
+    GCPolicy gc_policy;
+    GCStats gc_stats;
+    // The state of things at the end of the last full collection (and
+    // the start of the current one), for the policy.
+    double gc_cycle_start;
+    GCStats gc_cycle_stats;
+    size_t gc_heap_start; // bytes_allocated when marking started.
     // The gray_* information encodes the gray stack used by the GC.
     // The mark-sweep GC uses a tricolour abstraction:
     //   1. Black objects are marked, and already processed.
@@ -85,7 +268,11 @@ typedef struct VM {
     // ------------
 
     Table strings; // String interning
-    Table globals; // Globals
+    // Globals are resolved to an index into global_values at compile
+    // time. global_names maps each name to its index, and a global
+    // that hasn't been defined yet holds UNDEFINED_VAL.
+    Table global_names;
+    ValueArray global_values;
 
     // The compiler currently used to compile source, so that
     // if a GC happens during compilation, we can track roots.
@@ -103,6 +290,8 @@ void vm_drop(VM* vm, int count);
 void vm_push_root(VM* vm, Value value);
 void vm_pop_root(VM* vm);
 void vm_runtime_error(VM* vm, const char* format, ...);
+// A snapshot of the collector's counters.
+GCStats vm_gc_stats(VM* vm);
 InterpretResult vm_interpret(VM* vm, const char* source);
 
 // Object system
@@ -112,6 +301,9 @@ InterpretResult vm_interpret(VM* vm, const char* source);
 Value vm_get_prototype(VM* vm, Value value);
 bool vm_get_slot(VM* vm, Value src, Value slot_name, Value* slot_value);
 bool vm_has_ancestor(VM* vm, Value src, Value ancestor);
+// Registers the native currently found by looking up `name` on
+// `proto` as the given intrinsic.
+void vm_add_intrinsic(VM* vm, IntrinsicType type, ObjObject* proto, const char* name);
 
 // Invocation
 // ==========
@@ -169,6 +361,9 @@ bool vm_check_call(VM* vm, Value v, int num_args, ObjString* slot);
 uid_t vm_get_uid(VM* vm);
 void vm_add_extension(VM* vm, void* p, GCFn free);
 void vm_add_global(VM* vm, char* name, Value v);
+// Returns the index of the global called `name`, reserving a new
+// (undefined) one if there isn't one already.
+int vm_global_index(VM* vm, ObjString* name);
 
 Handle* handle_new(VM* vm, Value v);
 void handle_release(VM* vm, Handle* h);